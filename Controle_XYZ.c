@@ -1,6 +1,12 @@
 // Bibliotecas
 #include "pico/stdlib.h"        // Biblioteca padrao do Pico
 #include "pico/multicore.h"     // Biblioteca para suporte a múltiplos núcleos na Raspberry Pi Pico
+#include "pico/rand.h"          // Biblioteca de numeros aleatorios (id de boot dos ETags)
+#include "pico/unique_id.h"     // Biblioteca do id unico da placa (identifica o dispositivo no dbServer)
+#include "pico/sync.h"          // Biblioteca de secoes criticas entre os dois nucleos
+#include "hardware/sync.h"      // Biblioteca de spinlocks de hardware e barreiras de memoria
+#include "hardware/flash.h"     // Biblioteca de gravacao da flash (log persistente)
+#include "pico/flash.h"         // Biblioteca de execucao segura com a flash fora do XIP
 #include "hardware/gpio.h"      // Biblioteca de GPIO
 #include "hardware/adc.h"       // Biblioteca de ADC
 #include "hardware/i2c.h"       // Biblioteca de I2C
@@ -9,6 +15,8 @@
 
 #include "pico/cyw43_arch.h"    // Biblioteca para arquitetura Wi-Fi da Pico com CYW43
 #include "lwip/tcp.h"           // Biblioteca de LWIP para manipulacao de TCP/IP
+#include "mbedtls/sha1.h"       // SHA-1 do handshake WebSocket
+#include "mbedtls/base64.h"     // Base64 do handshake WebSocket
 
 #include "FreeRTOS.h"           // Biblioteca de FreeRTOS
 #include "task.h"               // Biblioteca de tasks
@@ -16,15 +24,18 @@
 #include "semphr.h"             // Biblioteca para Mutex/Semaforos
 
 #include "lib/HTML.h"           // Biblioteca para geracao de HTML
+#include "lib/http_routes.h"    // Slots da tabela de rotas HTTP (gerado por lib/gen_routes.py)
 #include "lib/lcd_1602_i2c.h"   // Biblioteca para Display LCD
 #include "lib/mfrc522.h"        // Biblioteca para o Sensor RFID
 
 #include <stdio.h>              // Biblioteca de entrada e saida padrao
 #include <stdlib.h>             // Biblioteca padrao
 #include <string.h>             // Biblioteca de strings
+#include <strings.h>            // Biblioteca de strings (strncasecmp)
 #include <ctype.h>              // Biblioteca de caracteres
 #include <stdarg.h>             // Biblioteca para manipulacao de argumentos variaveis
 #include <math.h>               // Biblioteca matematica
+#include <malloc.h>             // Biblioteca de alocacao (mallinfo)
 
 //----------------------------------VaRIAVEIS GLOBAIS----------------------------------
 
@@ -93,6 +104,8 @@ CellPosition g_cell_map[6] = {
     { .x_mm = 163.18, .y_mm = 53.75 }    // Celula 5 ("C2")
 };
 
+#define X_TRAVEL_MAX_MM 300.0   // Curso maximo fisico do Eixo X (area de trabalho)
+#define Y_TRAVEL_MAX_MM 180.0   // Curso maximo fisico do Eixo Y (area de trabalho)
 #define Z_TRAVEL_MAX_MM 45.0    // Curso maximo fisico do Eixo Z
 #define Z_SAFE_MM 0.0           // Altura Z segura 
 #define Z_PICKUP_MM 45.0        // Altura Z para pegar/soltar (45mm abaixo do topo)
@@ -115,32 +128,499 @@ volatile long g_last_target_steps_y = 0;
 #define I2C_SDA 8
 #define I2C_SCL 9
 #define I2C_ADDR 0x27 
+// O PCF8574 e especificado para 100 kHz. LCD_I2C_FAST=1 (ex: -DLCD_I2C_FAST=1) usa 400 kHz,
+// fora da especificacao: costuma funcionar, mas com fios longos ou pull-ups fracos pode
+// corromper caracteres ou travar o display. O envio em uma transacao ja e o grosso do ganho.
+#ifndef LCD_I2C_FAST
+#define LCD_I2C_FAST 0
+#endif
+#define I2C_BAUD ((LCD_I2C_FAST ? 400 : 100) * 1000)
+#define LCD_REFRESH_MS 50               // periodo da task do LCD (envia so o que mudou)
+#define LCD_PROGRESS_MS 250             // periodo da barra de progresso (e atraso antes de aparecer)
+#define LCD_BAR_CELLS 4                 // caracteres da barra (5 colunas cada: 20 niveis)
 
 QueueHandle_t g_movement_queue; // Fila de comandos de movimento
 
 // Estrutura do comando de movimento
 typedef struct {
-    int cell_index;             // indice da celula (0-5)
+    int cell_index;             // indice da celula (0-5), -1 = home, -2 = jog
     bool is_store_operation;    // true = guardar (soltar), false = retirar (pegar)
+    uint8_t jog_axis;           // jog: 0 = X, 1 = Y, 2 = Z
+    int32_t jog_steps;          // jog: deslocamento relativo em passos
+    uint32_t job_id;            // id para consulta (job_submit), 0 = sem acompanhamento
 } MovementCommand;
 
+// Clientes de Server-Sent Events (/api/events)
+#define SSE_MAX_CLIENTS 4
+#define SSE_PING_TICKS 15               // comentario de keep-alive a cada 15 polls (15s)
+
+// WebSocket de controle (/api/ws)
+#define WS_MAX_CLIENTS 2
+#define WS_PAYLOAD_MAX 125              // apenas frames curtos (comandos e controle)
+#define WS_OUT_MAX 160                  // frames de resposta aguardando envio
+
+// Comandos binarios do cliente (primeiro byte do payload; inteiros little-endian)
+#define WS_CMD_STORE    0x01            // [cmd, id, celula 0-5]
+#define WS_CMD_RETRIEVE 0x02            // [cmd, id, celula 0-5]
+#define WS_CMD_HOME     0x03            // [cmd, id]
+#define WS_CMD_MAGNET   0x04            // [cmd, id, 0 = desliga, 1 = liga, 2 = alterna]
+#define WS_CMD_JOG      0x05            // [cmd, id, eixo 0-2, passos int32]
+#define WS_CMD_STATUS   0x06            // [cmd, id]
+
+// Mensagens do servidor
+#define WS_MSG_ACK      0x80            // [0x80, id, resultado, job u32]
+#define WS_MSG_STATUS   0x81            // [0x81, estado binario (STATE_BIN_LEN bytes)]
+
+// Resultado de um comando (WebSocket e protocolo binario)
+#define CMD_OK          0
+#define CMD_ERR_INVALID 1               // comando/parametro invalido
+#define CMD_ERR_BUSY    2               // fila de movimento cheia
+
+// Protocolo binario maquina-a-maquina (integracao com o WMS)
+// Frame: [tamanho u16][tipo u8][seq u8][payload]; tamanho conta tipo + seq + payload.
+// Inteiros little-endian; a resposta repete o seq da requisicao com o tipo | 0x80.
+#define M2M_PORT 5020
+#define M2M_MAX_CLIENTS 4
+#define M2M_FRAME_MAX 64                // maior frame aceito do cliente
+#define M2M_OUT_MAX 1024                // frames aguardando espaco no buffer de envio
+#define M2M_REPLY_MAX 160               // maior frame gerado por vez (reserva antes de processar)
+
+#define M2M_PING        0x00            // [] -> []
+#define M2M_SUBMIT_JOB  0x01            // [op u8, celula u8, eixo u8, passos int32] -> [resultado u8, job u32]
+#define M2M_QUERY_JOB   0x02            // [job u32] -> [job u32, estado u8, op u8, celula u8]
+#define M2M_INVENTORY   0x03            // [] -> [n u8, n x {celula u8, uid_len u8, uid}]
+#define M2M_SUBSCRIBE   0x04            // [1 = assina, 0 = cancela] -> [estado binario]
+#define M2M_EVENT       0x90            // servidor: [evento u32, tipo_len u8, tipo, dados JSON]
+#define M2M_ERROR       0xFF            // servidor: [codigo u8]
+#define M2M_ERR_TYPE    1               // tipo desconhecido
+#define M2M_ERR_LENGTH  2               // payload curto demais
+
+// Operacoes de job (mesmos codigos do estado binario)
+#define JOB_OP_STORE    1
+#define JOB_OP_RETRIEVE 2
+#define JOB_OP_HOME     3
+#define JOB_OP_JOG      4
+
+// Conexoes HTTP persistentes (keep-alive)
+#define HTTP_POLL_INTERVAL 2            // tcp_poll em ticks de 500ms (1s)
+#define HTTP_IDLE_TIMEOUT_TICKS 10      // fecha conexoes ociosas apos 10 polls (10s)
+#define HTTP_KEEPALIVE_MAX 100          // requisicoes por conexao antes de fechar
+// Escalonador de envio: respostas grandes dividem a memoria do lwIP em rodizio
+#define HTTP_PRIORITY_MAX 1536                  // respostas ate este tamanho nao esperam atras das grandes
+#define HTTP_BULK_INFLIGHT (4 * TCP_MSS)        // bytes sem ACK por conexao com resposta grande
+#define HTTP_BULK_INFLIGHT_TOTAL (16 * TCP_MSS) // soma de todas: o resto dos segmentos fica para as pequenas
+#define HTTP_CHUNK_PREFIX 5             // "XXX\r\n": tamanho do pedaco em 3 digitos hex
+#define HTTP_CHUNK_SUFFIX 7             // "\r\n" do pedaco + "0\r\n\r\n" do ultimo
+
+// Gerenciamento das conexoes HTTP
+#define HTTP_MAX_CONNS 8                // conexoes simultaneas (SSE e WebSocket incluidos)
+#define HTTP_ACCEPT_BACKLOG 4           // conexoes aguardando o accept no lwIP
+#define HTTP_REQUEST_TIMEOUT_TICKS 10   // requisicao incompleta por 10 polls (10s): fecha
+#define HTTP_SEND_TIMEOUT_TICKS 20      // dados sem ACK por 20 polls (20s): cliente lento, aborta
+#define HTTP_TCP_KEEPALIVE_MS 30000     // keepalive TCP para detectar clientes que sumiram
+
+// Limite de requisicoes por IP (token bucket) nas rotas de comando
+#define RATE_MAX_CLIENTS 8              // IPs acompanhados (o menos recente e substituido)
+#define RATE_BURST 10                   // rajada maxima de requisicoes
+#define RATE_PER_SEC 4                  // fichas repostas por segundo
+#define QUEUE_FULL_RETRY_S 2            // Retry-After quando a fila de movimento esta cheia
+
+// Cache de respostas GET (corpos refeitos apenas quando a versao muda)
+#define HTTP_CACHE_HISTORY_MAX 8192     // historico maior que isso e gerado por partes, sem cache
+#define HTTP_CACHE_STATE_MAX 512
+
+// Limites do parser HTTP
+#define HTTP_METHOD_MAX 8
+#define HTTP_PATH_MAX 64
+#define HTTP_QUERY_MAX 256
+#define HTTP_HNAME_MAX 32
+#define HTTP_HVALUE_MAX 128
+#define HTTP_BODY_MAX 1024
+#define HTTP_MAX_PARAMS 8
+
+// Estados do parser incremental de requisicoes
+typedef enum {
+    HP_METHOD,          // lendo o metodo (GET, POST...)
+    HP_PATH,            // lendo o caminho ate '?' ou ' '
+    HP_QUERY,           // lendo a query string ate ' '
+    HP_VERSION,         // lendo a versao ate o fim da linha
+    HP_HEADER_NAME,     // lendo o nome de um header (linha vazia encerra os headers)
+    HP_HEADER_VALUE,    // lendo o valor de um header ate o fim da linha
+    HP_BODY,            // lendo Content-Length bytes de corpo
+    HP_DONE,            // requisicao completa
+    HP_ERROR            // requisicao invalida (status em error_status)
+} http_parse_state_t;
+
+// Parametro de query ja decodificado
+typedef struct {
+    const char *key;
+    const char *value;
+} http_param_t;
+
+// Requisicao sendo montada pelo parser (sem copiar a requisicao inteira)
+struct http_request
+{
+    http_parse_state_t state;
+    char method[HTTP_METHOD_MAX];
+    char path[HTTP_PATH_MAX];
+    char query[HTTP_QUERY_MAX];     // sem o '?'
+    char version[10];
+    uint8_t method_len;
+    uint8_t path_len;
+    uint16_t query_len;
+    uint8_t version_len;
+    char hname[HTTP_HNAME_MAX];     // header atual
+    char hvalue[HTTP_HVALUE_MAX];
+    uint8_t hname_len;
+    uint8_t hvalue_len;
+    char if_none_match[HTTP_HVALUE_MAX];
+    bool upgrade_ws;                // "Upgrade: websocket"
+    char ws_key[32];                // Sec-WebSocket-Key
+    bool conn_close;                // "Connection: close"
+    bool conn_keep_alive;           // "Connection: keep-alive"
+    size_t content_length;
+    char body[HTTP_BODY_MAX + 1];
+    size_t body_len;
+    const char *error_status;       // status HTTP quando state == HP_ERROR
+    http_param_t params[HTTP_MAX_PARAMS];   // query ja separada/decodificada (apontam para query)
+    uint8_t param_count;
+};
+
+struct http_state;
+
+// Corpo de resposta em cache, valido enquanto (version, aux) nao mudar.
+// Nao e refeito enquanto alguma conexao ainda envia o corpo antigo (refs > 0).
+typedef struct {
+    char *data;
+    size_t cap;
+    size_t len;
+    uint32_t version;               // ex: g_log_seq, g_event_seq
+    uint32_t aux;                   // segunda parte da chave (ex: profundidade da fila)
+    uint8_t refs;                   // respostas em envio apontando para data
+    bool valid;
+} HttpCacheEntry;
+enum { CACHE_HISTORY, CACHE_STATE_JSON, CACHE_STATE_BIN, CACHE_COUNT };
+
+// Gerador de corpo sob demanda: escreve o proximo pedaco em buf e retorna o tamanho.
+// Marca hs->gen_done quando o ultimo pedaco foi gerado.
+typedef size_t (*http_body_gen_t)(struct http_state *hs, char *buf, size_t cap);
+
+// Rota HTTP: metodo + caminho exatos -> handler
+typedef void (*http_handler_t)(struct http_state *hs, const struct http_request *req);
+typedef struct {
+    const char *method;
+    const char *path;
+    http_handler_t handler;
+    bool limited;               // sujeita ao limite por IP (rate_allow)
+} http_route_t;
+
+// Fichas de um IP no limite de requisicoes
+typedef struct {
+    uint32_t ip;
+    uint32_t last_ms;           // ultima reposicao
+    uint32_t tokens_milli;      // fichas * 1000
+    bool used;
+} RateBucket;
+
 // Struct para manter o estado da conexao HTTP
 struct http_state                               
 {
-    const char *response_ptr;   // ponteiro para o buffer com a resposta
-    char smallbuf[1024];        // usado para respostas pequenas/JSON
-    size_t len;                 // tamanho total da resposta
+    struct pbuf *rx_pbuf;       // bytes recebidos ainda nao consumidos pelo parser
+    struct http_request req;    // requisicao em montagem
+    char hdrbuf[256];           // cabecalho da resposta atual
+    size_t hdr_len;
+    const char *body_ptr;       // corpo da resposta (smallbuf, pagina HTML...), ou NULL
+    size_t body_len;
+    bool body_static;           // body_ptr aponta para dados constantes: enviado sem copia
+    HttpCacheEntry *cache_ref;  // entrada do cache usada como corpo (liberada ao fim da resposta)
+    uint8_t retry_after;        // segundos no header Retry-After (0 = sem header)
+    char smallbuf[1024];        // usado para corpos pequenos/JSON
+    http_body_gen_t body_gen;   // corpo gerado em smallbuf conforme a janela abre (ou NULL)
+    size_t gen_len;             // bytes gerados em smallbuf
+    size_t gen_off;             // bytes de smallbuf ja enfileirados
+    bool gen_done;              // gerador ja produziu o ultimo pedaco
+    bool chunked;               // corpo gerado enviado com Transfer-Encoding: chunked
+    uint8_t gen_stage;          // etapa do gerador (abertura, itens, fechamento)
+    uint32_t gen_pos;           // cursor do gerador (ex: seq do proximo log)
+    uint32_t gen_end;
+    uint32_t gen_count;         // itens ja emitidos
+    uint32_t gen_aux;           // valor extra do gerador (ex: primeira seq na flash)
+    struct tcp_pcb *pcb;        // conexao dona deste estado
+    bool sse;                   // conexao inscrita em /api/events
+    bool sse_ping;              // enviar comentario de keep-alive no proximo pedaco
+    uint8_t sse_ping_ticks;     // polls desde o ultimo ping
+    uint32_t sse_event_seq;     // proximo evento a enviar
+    uint32_t sse_log_seq;       // proxima linha de log a enviar
+    bool ws;                    // conexao convertida para WebSocket (/api/ws)
+    bool ws_status;             // enviar frame de status no proximo pedaco
+    bool ws_closing;            // frame de close enfileirado: encerra apos o envio
+    uint32_t ws_event_seq;      // eventos ja refletidos no ultimo status enviado
+    uint8_t ws_out[WS_OUT_MAX]; // frames de resposta prontos (acks, pong, close)
+    uint16_t ws_out_len;
     size_t sent;
     size_t offset;              // bytes ja enfileirados para envio
-    bool using_smallbuf;
+    bool busy;                  // ha uma resposta em envio
+    bool bulk;                  // resposta grande: envio limitado e escalonado (http_schedule)
+    bool keep_alive;            // mantem a conexao apos a resposta atual
+    bool peer_closed;           // cliente ja enviou FIN: fecha quando a resposta terminar
+    uint8_t idle_ticks;         // polls seguidos sem atividade
+    uint8_t req_ticks;          // polls desde o inicio da requisicao incompleta
+    uint8_t stall_ticks;        // polls com dados enviados sem ACK
+    uint16_t requests;          // requisicoes atendidas nesta conexao
 };
 
-// Historico de logs em memoria
-#define LOG_CAP 120
-#define LOG_LINE_MAX 128
-static char g_log[LOG_CAP][LOG_LINE_MAX];
-static int g_log_head = 0;  // aponta para a proxima posicao de escrita
-static int g_log_count = 0; // quantos registros validos
+// Historico de logs em memoria: anel escrito pelos dois nucleos (lwIP no nucleo 1, tasks
+// no nucleo 0). Cada entrada guarda a sua seq; reserva e publicacao usam um spinlock de
+// hardware por poucas instrucoes.
+// As linhas sao binarias: formato (ponteiro para a string constante em flash), instante e
+// argumentos crus. O texto so e montado na leitura (log_read_seq).
+// Niveis e subsistemas do log. Chamadas abaixo de LOG_LEVEL nao sao compiladas; acima
+// dele, g_log_levels filtra cada subsistema em tempo de execucao (/api/log-level).
+#define LOG_LVL_TRACE 0
+#define LOG_LVL_DEBUG 1
+#define LOG_LVL_INFO 2
+#define LOG_LVL_WARN 3
+#define LOG_LVL_ERROR 4
+#define LOG_LVL_OFF 5
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LVL_INFO      // nivel minimo compilado (-DLOG_LEVEL=0 para tudo)
+#endif
+
+typedef enum { LOG_SUB_SYS, LOG_SUB_MOTION, LOG_SUB_RFID, LOG_SUB_HTTP, LOG_SUB_LCD, LOG_SUB_COUNT } log_sub_t;
+
+// LOG_*: linha no historico (RAM, flash e dbServer). PRINT_*: apenas no console serial.
+#if LOG_LEVEL <= LOG_LVL_TRACE
+#define LOG_TRACE(sub, ...) log_push(LOG_LVL_TRACE, sub, __VA_ARGS__)
+#define PRINT_TRACE(sub, ...) log_print(LOG_LVL_TRACE, sub, __VA_ARGS__)
+#else
+#define LOG_TRACE(sub, ...) ((void)0)
+#define PRINT_TRACE(sub, ...) ((void)0)
+#endif
+#if LOG_LEVEL <= LOG_LVL_DEBUG
+#define LOG_DEBUG(sub, ...) log_push(LOG_LVL_DEBUG, sub, __VA_ARGS__)
+#define PRINT_DEBUG(sub, ...) log_print(LOG_LVL_DEBUG, sub, __VA_ARGS__)
+#else
+#define LOG_DEBUG(sub, ...) ((void)0)
+#define PRINT_DEBUG(sub, ...) ((void)0)
+#endif
+#if LOG_LEVEL <= LOG_LVL_INFO
+#define LOG_INFO(sub, ...) log_push(LOG_LVL_INFO, sub, __VA_ARGS__)
+#define PRINT_INFO(sub, ...) log_print(LOG_LVL_INFO, sub, __VA_ARGS__)
+#else
+#define LOG_INFO(sub, ...) ((void)0)
+#define PRINT_INFO(sub, ...) ((void)0)
+#endif
+#if LOG_LEVEL <= LOG_LVL_WARN
+#define LOG_WARN(sub, ...) log_push(LOG_LVL_WARN, sub, __VA_ARGS__)
+#define PRINT_WARN(sub, ...) log_print(LOG_LVL_WARN, sub, __VA_ARGS__)
+#else
+#define LOG_WARN(sub, ...) ((void)0)
+#define PRINT_WARN(sub, ...) ((void)0)
+#endif
+#if LOG_LEVEL <= LOG_LVL_ERROR
+#define LOG_ERROR(sub, ...) log_push(LOG_LVL_ERROR, sub, __VA_ARGS__)
+#define PRINT_ERROR(sub, ...) log_print(LOG_LVL_ERROR, sub, __VA_ARGS__)
+#else
+#define LOG_ERROR(sub, ...) ((void)0)
+#define PRINT_ERROR(sub, ...) ((void)0)
+#endif
+
+static const char *const g_log_level_names[] = { "TRACE", "DEBUG", "INFO", "WARN", "ERROR", "OFF" };
+static const char *const g_log_sub_names[LOG_SUB_COUNT] = { "sys", "motion", "rfid", "http", "lcd" };
+static volatile uint8_t g_log_levels[LOG_SUB_COUNT] = { LOG_LEVEL, LOG_LEVEL, LOG_LEVEL, LOG_LEVEL, LOG_LEVEL };
+
+// Nivel, subsistema e instante de uma linha do log
+typedef struct {
+    uint32_t ts_ms;
+    uint8_t level;
+    uint8_t sub;
+} LogMeta;
+
+#define LOG_CAP 256                 // potencia de 2: posicao = seq & (LOG_CAP - 1)
+#define LOG_LINE_MAX 128            // linha formatada na leitura
+#define LOG_HEAD_DATA 33            // bytes de argumentos no primeiro registro da linha
+#define LOG_CONT_DATA 40            // bytes de argumentos em cada registro de continuacao
+#define LOG_SPAN_MAX 4              // registros por linha (strings longas continuam nos seguintes)
+#define LOG_ARGS_MAX (LOG_HEAD_DATA + (LOG_SPAN_MAX - 1) * LOG_CONT_DATA)
+#define HISTORY_WAIT_MAX_S 25       // espera maxima de /api/history?since=&wait= (long-poll)
+#define HISTORY_LIMIT_DEFAULT 50    // linhas por resposta de /api/history?since= (RAM)
+#define HISTORY_LIMIT_MAX LOG_CAP   // o anel nao guarda mais que isso
+typedef struct {
+    volatile uint32_t seq;          // seq + 1 com o registro publicado (0 = sendo escrito)
+    const char *fmt;                // formato da linha (NULL = continuacao da linha anterior)
+    union {
+        struct {
+            uint32_t ts_ms;         // instante do log_push (ms desde o boot)
+            uint8_t span;           // registros usados pela linha
+            uint8_t len;            // bytes de argumentos
+            uint8_t tag;            // nivel << 4 | subsistema
+            uint8_t data[LOG_HEAD_DATA];
+        };
+        uint8_t cont[LOG_CONT_DATA];
+    };
+} LogEntry;
+static LogEntry g_log[LOG_CAP];
+static spin_lock_t *g_log_lock;             // reserva/publicacao de posicoes no anel
+static uint32_t g_log_reserved = 0;         // proxima seq a reservar (protegida por g_log_lock)
+static volatile uint32_t g_log_seq = 0;     // linhas publicadas, em ordem (versao do log)
+static uint32_t g_log_dropped = 0;          // linhas descartadas com o anel cheio de reservas
+
+// Log persistente: registros de 128 bytes com CRC nos ultimos 128 KB da flash, gravados
+// em sequencia e apagando o setor seguinte ao chegar nele (rodizio = desgaste uniforme).
+// A seq persistente continua entre reinicios: o registro de seq S fica sempre na posicao
+// (base_pos + S - base_seq) % FLOG_RECORDS.
+#define FLOG_SECTORS 32
+#define FLOG_SIZE (FLOG_SECTORS * FLASH_SECTOR_SIZE)
+#define FLOG_OFFSET (PICO_FLASH_SIZE_BYTES - FLOG_SIZE)
+#define FLOG_REC_SIZE 128
+#define FLOG_TEXT_MAX 112
+#define FLOG_PER_PAGE (FLASH_PAGE_SIZE / FLOG_REC_SIZE)
+#define FLOG_PER_SECTOR (FLASH_SECTOR_SIZE / FLOG_REC_SIZE)
+#define FLOG_RECORDS (FLOG_SECTORS * FLOG_PER_SECTOR)  // potencia de 2
+#define FLOG_MAGIC 0x4C47                       // "GL"
+#define FLOG_FLAG_BOOT 0x01                     // primeira linha gravada apos um reinicio
+#define FLOG_FLAG_LEVEL_SHIFT 1                 // bits 1-3: nivel da linha
+#define FLOG_FLAG_SUB_SHIFT 4                   // bits 4-7: subsistema
+#define FLOG_POLL_MS 250                        // periodo da task de gravacao
+#define FLOG_BATCH 8                            // linhas pendentes que disparam a gravacao
+#define FLOG_FLUSH_MS 5000                      // grava o que houver apos este tempo
+#define FLOG_LIMIT_DEFAULT 50                   // linhas por resposta de /api/history?flash=1&since=
+#define FLOG_LIMIT_MAX 500
+
+struct FlashLogRecord {
+    uint16_t magic;
+    uint8_t len;                    // bytes de texto
+    uint8_t flags;
+    uint32_t seq;                   // seq persistente
+    uint32_t ts_ms;                 // ms desde o boot em que a linha foi registrada
+    char text[FLOG_TEXT_MAX];
+    uint32_t crc;                   // CRC-32 dos campos anteriores
+};
+_Static_assert(sizeof(struct FlashLogRecord) == FLOG_REC_SIZE, "registro do log na flash");
+
+static struct {
+    uint32_t base_pos;              // posicao do registro de seq base_seq
+    uint32_t base_seq;
+    uint32_t pos;                   // proxima posicao a gravar
+    volatile uint32_t next_seq;     // seq do proximo registro (fim do intervalo legivel)
+    volatile uint32_t oldest_seq;   // menor seq ainda na flash
+    uint32_t ram_seq;               // proxima linha do log em RAM a persistir
+    uint32_t lost;                  // linhas sobrescritas na RAM antes de serem gravadas
+    uint32_t last_flush_ms;
+    bool booted;                    // ja gravou a primeira linha deste boot
+} g_flog;
+
+// Operacao executada com a flash fora do XIP (flash_safe_execute)
+typedef struct {
+    uint32_t offset;                // pagina a programar
+    const uint8_t *page;
+    bool erase;                     // apaga o setor da pagina antes
+} FlashLogOp;
+
+static volatile bool g_motion_busy = true;  // motores em uso (inclui o homing inicial)
+
+// Progresso do movimento atual: escrito pelo laco de passos (motion_progress_*), lido pela
+// task do LCD. gen muda a cada movimento, para o leitor descartar uma copia misturada.
+static struct {
+    volatile uint32_t gen;
+    volatile bool active;
+    volatile uint32_t done;         // iteracoes do laco ja feitas (passos do eixo mais longo)
+    uint32_t total;
+    uint32_t start_ms;
+    long from_x, from_y, from_z;    // posicao no inicio (passos)
+    long dx, dy, dz;                // deslocamento com sinal (passos)
+} g_motion_progress;
+
+// Envio do log ao dbServer.py: o nucleo 1 le o log da flash e faz um POST por lote.
+// A marca d'agua (ultima seq confirmada) fica num setor proprio logo abaixo do log.
+#define LOG_UPLINK_HOST ""                  // IP do dbServer.py ("" desativa o envio)
+#define LOG_UPLINK_PORT 5000
+#define UPLINK_BATCH_MAX 32                 // linhas por POST
+#define UPLINK_BODY_MAX 3072
+#define UPLINK_TAIL_MAX 24                  // fecho do lote: ],"to":<seq>}
+#define UPLINK_RESP_MAX 512                 // resposta guardada (status + cabecalhos + JSON)
+#define UPLINK_POLL_MS 1000                 // intervalo entre verificacoes de linhas novas
+#define UPLINK_TIMEOUT_MS 10000             // tentativa sem resposta: desiste
+#define UPLINK_BACKOFF_MIN_MS 2000          // espera apos uma falha (dobra a cada falha seguida)
+#define UPLINK_BACKOFF_MAX_MS 60000
+#define UPLINK_HWM_OFFSET (FLOG_OFFSET - FLASH_SECTOR_SIZE)
+#define UPLINK_HWM_SLOTS (FLASH_SECTOR_SIZE / 8)   // entradas {seq, ~seq} antes de apagar o setor
+extern char __flash_binary_end;             // fim do firmware na flash (linker script do SDK)
+
+typedef enum { UPLINK_IDLE, UPLINK_CONNECTING, UPLINK_WAITING } uplink_state_t;
+
+static struct {
+    uplink_state_t state;
+    struct tcp_pcb *pcb;
+    uint32_t batch_last;            // ultima seq do lote em envio
+    char device[2 * PICO_UNIQUE_BOARD_ID_SIZE_BYTES + 1];   // id unico da placa (chave no servidor)
+    volatile uint32_t acked_seq;    // ultima seq confirmada pelo servidor (marca d'agua)
+    uint32_t stored_seq;            // marca d'agua gravada na flash
+    uint32_t hwm_slot;              // proxima entrada livre no setor da marca d'agua
+    uint32_t started_ms;            // inicio da tentativa atual
+    uint32_t next_try_ms;
+    uint32_t backoff_ms;
+    char resp[UPLINK_RESP_MAX];     // resposta do servidor (lida ate ele fechar)
+    uint16_t resp_len;
+    char hdr[160];
+    uint16_t hdr_len;
+    char body[UPLINK_BODY_MAX];
+    uint16_t body_len;
+    uint16_t sent_off;              // bytes de hdr + body ja enfileirados
+} g_uplink;
+
+// Versoes usadas nos ETags das respostas
+static volatile uint32_t g_state_version = 0;   // incrementa quando eletroima/inventario mudam
+static uint32_t g_html_etag = 0;                // hash da pagina HTML
+static uint32_t g_boot_id = 0;                  // diferencia os ETags dinamicos entre reinicios
+
+// Conexoes HTTP vivas e contadores do gerenciador de conexoes
+static struct http_state *g_http_conns[HTTP_MAX_CONNS];
+static struct {
+    uint32_t accepted;              // conexoes aceitas
+    uint32_t rejected;              // recusadas (limite atingido, sem memoria)
+    uint32_t evicted;               // fechadas por ociosidade/lentidao para liberar recursos
+    uint32_t errors;                // perdidas por erro (RST, timeout do lwIP)
+} g_http_stats;
+
+// Eventos de estado publicados para os clientes SSE (/api/events)
+#define EVENT_CAP 32
+#define EVENT_DATA_MAX 112
+typedef struct {
+    const char *type;               // nome do evento SSE (job, position, inventory, magnet)
+    char data[EVENT_DATA_MAX];      // JSON do evento
+} DeviceEvent;
+static DeviceEvent g_events[EVENT_CAP];
+static volatile uint32_t g_event_seq = 0;  // seq do proximo evento (o evento n fica em n % EVENT_CAP)
+static critical_section_t g_event_cs;      // protege g_events e g_job entre os dois nucleos
+
+// Job em execucao na task de motores (atualizado por job_phase)
+typedef struct {
+    bool active;
+    uint32_t id;                    // id do job (0 = enviado sem acompanhamento)
+    int cell;                       // indice da celula, -1 = sem celula (home, jog)
+    const char *op;                 // "store", "retrieve", "home", "jog"
+    const char *phase;              // ultima fase publicada
+} JobStatus;
+static JobStatus g_job = { .active = false, .id = 0, .cell = -1, .op = "", .phase = "" };
+
+// Jobs recentes, consultados por id (o job n fica em n % JOB_TRACK)
+#define JOB_TRACK 16
+typedef enum { JOB_UNKNOWN = 0, JOB_QUEUED, JOB_RUNNING, JOB_DONE, JOB_ABORTED } job_state_t;
+typedef struct {
+    uint32_t id;
+    uint8_t state;                  // job_state_t
+    uint8_t op;                     // JOB_OP_*
+    int8_t cell;                    // -1 = sem celula
+} JobRecord;
+static JobRecord g_jobs[JOB_TRACK];             // protegido por g_event_cs
+static uint32_t g_next_job_id = 1;
+
+// Estado em binario (/api/state?fmt=bin e status do WebSocket), inteiros little-endian:
+// [flags, fila, celulas, x int32, y int32, z int32, job_op, job_celula]
+// flags: bit 0 = eletroima, bit 1 = job ativo; celulas: bit i = celula i ocupada;
+// job_op: 0 = nenhum, 1 = store, 2 = retrieve, 3 = home, 4 = jog; job_celula: 0xFF = nenhuma
+#define STATE_BIN_LEN 17
 
 // Variavel do eletroima
 bool electromagnet_active = false;
@@ -149,8 +629,20 @@ MFRC522Ptr_t g_mfrc; // Ponteiro global para a instancia do MFRC522
 
 #define UID_STRLEN 32                           // Espaco para UID (ex: "12 34 56 78 ")
 static char g_cell_uids[6][UID_STRLEN];         // Armazena a UID de qual pallet esta em qual slot
-static SemaphoreHandle_t g_inventory_mutex;     // Protege g_cell_uids
-static SemaphoreHandle_t g_lcd_mutex;           // Protege g_cell_uids
+static critical_section_t g_inventory_cs;       // Protege g_cell_uids entre os dois nucleos (o nucleo 1 nao e do FreeRTOS)
+
+// Conteudo do LCD: quem chama lcd_update_line so escreve em fb; a task do LCD (unica dona
+// do I2C depois do boot) compara com shown e envia apenas os caracteres que mudaram
+static struct {
+    char fb[MAX_LINES][MAX_CHARS];      // conteudo desejado (protegido por g_lcd_cs)
+    char shown[MAX_LINES][MAX_CHARS];   // o que esta no display (so a task do LCD)
+    volatile uint32_t version;          // incrementada a cada mudanca em fb ou na barra
+    uint32_t drawn;                     // versao ja enviada ao display
+    char bar[MAX_CHARS];                // linha de progresso do movimento (so a task do LCD)
+    bool bar_on;                        // bar substitui a linha 1 de fb
+} g_lcd;
+static critical_section_t g_lcd_cs;     // protege g_lcd.fb entre os dois nucleos
+static TaskHandle_t g_lcd_task;         // acordada por lcd_update_line nas tasks do nucleo 0
 
 // Estrutura para armazenar tokens válidos em memória
 #define MAX_ACTIVE_TOKENS 10
@@ -166,23 +658,82 @@ static int token_count = 0;
 //---------------------------------------FUNcoES---------------------------------------
 
 void core1_polling(void);
+void vLogFlushTask(void *pvParameters);
+void vLcdTask(void *pvParameters);
 
 // Funcoes do servidor HTTP
 static void send_next_chunk(struct tcp_pcb *tpcb, struct http_state *hs);
+static size_t http_gen_fill(struct http_state *hs);
+static size_t http_bulk_allowance(const struct http_state *hs);
+static void http_schedule(void);
+static bool http_response_done(const struct http_state *hs);
 static err_t http_sent(void *arg, struct tcp_pcb *tpcb, u16_t len);
 static err_t http_recv(void *arg, struct tcp_pcb *tpcb, struct pbuf *p, err_t err);
+static err_t http_poll(void *arg, struct tcp_pcb *tpcb);
+static err_t http_close(struct tcp_pcb *tpcb, struct http_state *hs);
+static err_t http_abort(struct tcp_pcb *tpcb, struct http_state *hs);
+static void http_err(void *arg, err_t err);
+static void http_free_state(struct http_state *hs);
+static bool http_conn_register(struct http_state *hs);
+static void sse_unregister(struct http_state *hs);
+static err_t http_process_pending(struct tcp_pcb *tpcb, struct http_state *hs);
+static void http_parser_reset(struct http_request *r);
+static size_t http_parser_feed(struct http_request *r, const char *data, size_t len);
+static void http_parser_header(struct http_request *r);
+static bool http_wants_keep_alive(const struct http_request *req);
+static void http_finish_response(struct http_state *hs, const char *status, const char *content_type, const char *etag);
+static uint32_t route_hash(const char *method, const char *path);
+static void http_router_check(void);
+static void http_parse_params(struct http_request *req);
+static void http_handle_request(struct http_state *hs, struct http_request *req);
+static void route_connections(struct http_state *hs, const struct http_request *req);
 static err_t connection_callback(void *arg, struct tcp_pcb *newpcb, err_t err);
 static void start_http_server(void);
+static void start_m2m_server(void);
+static void m2m_pump(void);
+static int m2m_client_count(void);
 static int url_hex(char c);
 static void url_decode_inplace(char *s);
-static bool query_param(const char *req, const char *key, char *out, size_t outsz);
+static const char *http_param(const struct http_request *req, const char *key);
+static bool query_param(const struct http_request *req, const char *key, char *out, size_t outsz);
+static void http_assets_init(void);
+static uint32_t fnv1a32(const void *data, size_t len);
+static bool http_if_none_match(const struct http_request *req, const char *etag);
+static void http_make_etag(char *out, size_t outsz, char tag, uint32_t version);
+static void http_not_modified(struct http_state *hs, const char *etag);
+static size_t json_escape(char *out, size_t outsz, const char *in);
+static size_t history_json_gen(struct http_state *hs, char *buf, size_t cap);
+static size_t history_delta_gen(struct http_state *hs, char *buf, size_t cap);
+static HttpCacheEntry *http_cache_lookup(int key, uint32_t version, uint32_t aux, bool *hit);
+static void http_cache_serve(struct http_state *hs, HttpCacheEntry *e);
+static void http_cache_release(struct http_state *hs);
+static bool rate_allow(uint32_t ip, uint8_t *retry_s);
+static void http_submit_job(struct http_state *hs, MovementCommand *cmd);
+static size_t sse_event_gen(struct http_state *hs, char *buf, size_t cap);
+static void stream_pump(void);
+static size_t state_json(char *buf, size_t cap);
+static size_t state_binary(uint8_t *out);
+static void put_i32_le(uint8_t *p, int32_t v);
+static JobStatus job_snapshot(void);
+static void inventory_snapshot(char out[6][UID_STRLEN]);
+static unsigned queue_depth(void);
+static void ws_unregister(struct http_state *hs);
+static void ws_process_pending(struct tcp_pcb *tpcb, struct http_state *hs);
+static void ws_command(struct http_state *hs, const uint8_t *p, size_t n);
+static bool ws_queue_frame(struct http_state *hs, uint8_t opcode, const uint8_t *data, size_t len);
+static void ws_queue_close(struct http_state *hs, uint16_t code);
+static size_t ws_frame_gen(struct http_state *hs, char *buf, size_t cap);
 
 // Funcoes para movimentacao dos eixos
 static void init_cnc_pins(void);
 static void step_motor(uint step_pin, uint dir_pin, bool direction, uint delay_us);
 static void home_all_axes(void);
 static void move_axes_to_steps(long target_x, long target_y, long target_z);
-static void execute_cell_operation(int cell_index, bool is_pickup_operation);
+static void jog_axis(uint8_t axis, long steps);
+static void motion_progress_begin(long tx, long ty, long tz, long total);
+static inline void motion_progress_step(long done);
+static void motion_progress_end(void);
+static bool execute_cell_operation(int cell_index, bool is_pickup_operation);
 static int slot_para_indice(char *slot); 
 static const char* indice_para_slot(int idx);
 
@@ -192,13 +743,38 @@ static void ativar_eletroima(void);
 static void desativar_eletroima(void);
 static void toggle_eletroima(void);
 
+// Funcoes de eventos (SSE)
+static void event_publish(const char *type, const char *fmt, ...);
+static bool event_get(uint32_t *seq, DeviceEvent *out);
+static void job_phase(int cell, const char *op, const char *phase);
+static uint32_t job_submit(MovementCommand *cmd);
+static void job_set_state(uint32_t id, job_state_t state);
+static bool job_lookup(uint32_t id, JobRecord *out);
+
 // Funcoes de log
-static void log_push(const char *fmt, ...);
-static const char *log_get(int idx);
+static void log_push(uint8_t level, uint8_t sub, const char *fmt, ...);
+static void log_print(uint8_t level, uint8_t sub, const char *fmt, ...);
+static bool log_read_seq(uint32_t seq, char *out, size_t outsz, LogMeta *meta);
+static void route_log_level(struct http_state *hs, const struct http_request *req);
+static void flog_init(void);
+static void flog_flush(void);
+static void flog_flash_op(void *param);
+static const struct FlashLogRecord *flog_record(uint32_t seq);
+static uint32_t crc32_calc(const void *data, size_t len);
+static size_t flog_json_gen(struct http_state *hs, char *buf, size_t cap);
+static void uplink_hwm_init(void);
+static void uplink_hwm_store(void);
+static void uplink_pump(void);
+static void uplink_pump_locked(void);
+static size_t log_format(char *out, size_t outsz, const char *fmt, const uint8_t *data, size_t len);
+static uint32_t log_count(void);
 static bool scan_for_uid(char* uid_buffer, size_t buffer_len);
 
 // Funcoes do display LCD I2C
 void lcd_update_line(int line, const char *fmt, ...);
+static void lcd_fb_init(void);
+static void lcd_render(void);
+static void lcd_progress_update(void);
 
 // Função para validar token
 static bool validate_token(const char *token);
@@ -210,35 +786,42 @@ static bool extract_token(const char *req, char *token_out, size_t out_len);
 
 void core1_polling() 
 {
-    printf("\n=== Inicializando Stack de Rede... ===\n", get_core_num());
+    PRINT_INFO(LOG_SUB_SYS, "\n=== Inicializando Stack de Rede... ===\n");
+
+    // Permite que o nucleo 0 pause este nucleo ao gravar o log na flash
+    flash_safe_execute_core_init();
 
     // 1. Inicializa hardware Wi-Fi (NO CORE 1)
     if (cyw43_arch_init()) {
-        printf("ERRO FATAL: Falha Wi-Fi init\n", get_core_num());
+        PRINT_ERROR(LOG_SUB_SYS, "ERRO FATAL: Falha Wi-Fi init\n");
         return;
     }
 
     cyw43_arch_enable_sta_mode();
     
-    // Atualiza LCD (usando Mutex pois I2C é compartilhado)
+    // Atualiza o framebuffer do LCD (a task do LCD envia ao display)
     lcd_update_line(1, "Conectando...");
-    printf("Conectando ao Wi-Fi...\n", get_core_num());
+    PRINT_INFO(LOG_SUB_SYS, "Conectando ao Wi-Fi...\n");
 
     // 2. Conecta ao Wi-Fi (NO CORE 1)
     if (cyw43_arch_wifi_connect_timeout_ms(WIFI_SSID, WIFI_PASS, CYW43_AUTH_WPA2_AES_PSK, 15000)) {
-        printf("ERRO: Falha conexao Wi-Fi\n", get_core_num());
+        PRINT_ERROR(LOG_SUB_SYS, "ERRO: Falha conexao Wi-Fi\n");
         lcd_update_line(1, "WIFI CONNECT FALHOU");
     } else {
         // Sucesso na conexão
         uint8_t *ip = (uint8_t *)&(cyw43_state.netif[0].ip_addr.addr);
-        printf("CONECTADO! IP: %d.%d.%d.%d\n", get_core_num(), ip[0], ip[1], ip[2], ip[3]);
+        PRINT_INFO(LOG_SUB_SYS, "CONECTADO! IP: %d.%d.%d.%d\n", ip[0], ip[1], ip[2], ip[3]);
         
         char ip_buffer[17];
         snprintf(ip_buffer, 17, "IP:%d.%d.%d.%d", ip[0], ip[1], ip[2], ip[3]);
         lcd_update_line(1, ip_buffer);
         
-        // 3. Inicia Servidor HTTP (NO CORE 1)
+        // 3. Inicia Servidor HTTP e o protocolo binario (NO CORE 1). Fora dos callbacks,
+        // toda chamada tcp_* trava a pilha: o lwIP roda na IRQ (threadsafe_background)
+        cyw43_arch_lwip_begin();
         start_http_server();
+        start_m2m_server();
+        cyw43_arch_lwip_end();
     }
 
     // 4. Loop infinito de processamento de rede
@@ -246,6 +829,12 @@ void core1_polling()
     {
         // Como o init foi feito neste core, os callbacks virão para cá.
         cyw43_arch_poll(); 
+
+        // Envia eventos/logs novos para os clientes de /api/events e /api/ws
+        stream_pump();
+
+        // Envia ao dbServer as linhas do log que ele ainda nao confirmou
+        uplink_pump();
         
         sleep_ms(1); 
     }
@@ -254,19 +843,19 @@ void core1_polling()
 // Task de controle da CNC
 void vMotorControlTask(void *pvParameters)
 {
-    printf("Motor Task iniciada. Inicializando pinos da CNC...\n");
+    PRINT_INFO(LOG_SUB_MOTION, "Motor Task iniciada. Inicializando pinos da CNC...\n");
     init_cnc_pins();
 
     // 1. Zera a maquina ANTES de aceitar qualquer comando
-    printf("Iniciando Homing da CNC...\n");
-    log_push("CNC: Iniciando Homing...");
+    PRINT_INFO(LOG_SUB_MOTION, "Iniciando Homing da CNC...\n");
+    LOG_INFO(LOG_SUB_MOTION, "CNC: Iniciando Homing...");
     lcd_update_line(0, "Iniciando Homing");  
     lcd_update_line(1, "Aguarde...");        
     
     //home_all_axes();
     
-    printf("Homing concluido! Maquina em (0, 0, 0).\n");
-    log_push("CNC: Homing concluido.");
+    PRINT_INFO(LOG_SUB_MOTION, "Homing concluido! Maquina em (0, 0, 0).\n");
+    LOG_INFO(LOG_SUB_MOTION, "CNC: Homing concluido.");
     lcd_update_line(0, "Status: Pronto");  
     lcd_update_line(1, "");             
 
@@ -275,6 +864,7 @@ void vMotorControlTask(void *pvParameters)
     
     // 2. Move para uma posicao inicial segura
     move_axes_to_steps(g_current_steps_x, g_current_steps_y, z_safe_steps);
+    g_motion_busy = false;
 
     MovementCommand cmd;
 
@@ -284,34 +874,86 @@ void vMotorControlTask(void *pvParameters)
         // Aguarda um comando da fila (vindo do http_recv)
         if (xQueueReceive(g_movement_queue, &cmd, portMAX_DELAY) == pdPASS)
         {
+            g_motion_busy = true; // segura a gravacao do log na flash ate o fim do movimento
+            job_set_state(cmd.job_id, JOB_RUNNING);
+            if (cmd.job_id == 0) {
+                critical_section_enter_blocking(&g_event_cs);
+                g_job.id = 0;
+                critical_section_exit(&g_event_cs);
+            }
+            bool ok = true;
+
             // Verifica se e um comando de home (cell_index == -1)
             if (cmd.cell_index == -1) {
-                printf("Comando de HOME recebido. Retornando a (0,0,0)...\n");
-                log_push("CNC: Retornando ao home (0,0,0)");
+                PRINT_DEBUG(LOG_SUB_MOTION, "Comando de HOME recebido. Retornando a (0,0,0)...\n");
+                LOG_INFO(LOG_SUB_MOTION, "CNC: Retornando ao home (0,0,0)");
+                job_phase(-1, "home", "movendo");
                 lcd_update_line(0, "Retornando Home");
                 lcd_update_line(1, "Aguarde...");
                 
                 // Move para (0,0,0)
                 move_axes_to_steps(0, 0, 0);
                 
-                log_push("CNC: Home concluido (0,0,0)");
-                printf("Retorno ao home concluido.\n");
+                job_phase(-1, "home", "concluido");
+                LOG_INFO(LOG_SUB_MOTION, "CNC: Home concluido (0,0,0)");
+                PRINT_DEBUG(LOG_SUB_MOTION, "Retorno ao home concluido.\n");
                 lcd_update_line(0, "Status: Pronto");
                 lcd_update_line(1, "Home OK");
+            } else if (cmd.cell_index == -2) {
+                // Jog: deslocamento relativo de um eixo (WebSocket)
+                job_phase(-1, "jog", "movendo");
+                jog_axis(cmd.jog_axis, cmd.jog_steps);
+                job_phase(-1, "jog", "concluido");
             } else {
                 // Comando normal de celula
-                printf("Comando recebido: Celula %d, Operacao: %s\n", 
+                PRINT_DEBUG(LOG_SUB_MOTION, "Comando recebido: Celula %d, Operacao: %s\n", 
                        cmd.cell_index, cmd.is_store_operation ? "GUARDAR" : "RETIRAR");
                 
                 bool is_pickup = !cmd.is_store_operation;
                 
                 // 4. Chama a funcao de movimento
-                execute_cell_operation(cmd.cell_index, is_pickup);
+                ok = execute_cell_operation(cmd.cell_index, is_pickup);
             }
+            job_set_state(cmd.job_id, ok ? JOB_DONE : JOB_ABORTED);
+            g_motion_busy = false;
         }
     }
 }
 
+// Task que grava o log na flash. Roda apenas com os motores parados: programar/apagar a
+// flash desliga o XIP e as interrupcoes, o que atrasaria os passos de um movimento.
+void vLogFlushTask(void *pvParameters)
+{
+    while (true)
+    {
+        vTaskDelay(pdMS_TO_TICKS(FLOG_POLL_MS));
+        uint32_t pending = g_log_seq - g_flog.ram_seq;
+        bool hwm_dirty = g_uplink.acked_seq != g_uplink.stored_seq;
+        uint32_t now = to_ms_since_boot(get_absolute_time());
+        if ((pending == 0 && !hwm_dirty) || g_motion_busy || queue_depth() > 0)
+            continue;
+        // Junta varias linhas por gravacao; poucas linhas esperam ate FLOG_FLUSH_MS
+        if (pending < FLOG_BATCH && now - g_flog.last_flush_ms < FLOG_FLUSH_MS)
+            continue;
+        flog_flush();
+        uplink_hwm_store();
+        g_flog.last_flush_ms = now;
+    }
+}
+
+// Task do LCD: unica dona do I2C apos o boot. Os demais so escrevem no framebuffer.
+// Roda acima da task do motor para a barra de progresso andar durante o movimento.
+void vLcdTask(void *pvParameters)
+{
+    while (true)
+    {
+        lcd_progress_update();
+        lcd_render();
+        // Acorda antes se uma task do nucleo 0 mudou o texto (lcd_update_line)
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(LCD_REFRESH_MS));
+    }
+}
+
 //----------------------------------------MAIN-----------------------------------------
 
 int main()
@@ -320,7 +962,7 @@ int main()
     sleep_ms(4000); // Delay para o monitor serial conectar
 
     // --- INICIALIZA I2C E LCD ---
-    i2c_init(I2C_PORT, 100 * 1000); 
+    i2c_init(I2C_PORT, I2C_BAUD); 
     gpio_set_function(I2C_SDA, GPIO_FUNC_I2C);
     gpio_set_function(I2C_SCL, GPIO_FUNC_I2C);
     gpio_pull_up(I2C_SDA);
@@ -328,45 +970,35 @@ int main()
     sleep_ms(100); 
 
     lcd_init(I2C_PORT, I2C_ADDR);
-    lcd_clear();
-    lcd_set_cursor(0, 0);
-    lcd_string("Iniciando...");
-    lcd_set_cursor(1, 0);
-    lcd_string("v1.0");
-
-    // --- CRIA O MUTEX DO LCD ---
-    g_lcd_mutex = xSemaphoreCreateMutex();
-    if (g_lcd_mutex == NULL) {
-        printf("Falha ao criar Mutex do LCD!\n");
-        lcd_set_cursor(0, 0); lcd_string("ERRO FATAL");
-        lcd_set_cursor(1, 0); lcd_string("MUTEX LCD FALHOU");
-        while(true); // Trava aqui
-    }
-
-    // --- CRIA O MUTEX DO INVENTARIO ---
-    g_inventory_mutex = xSemaphoreCreateMutex();
-    if (g_inventory_mutex == NULL) {
-        printf("Falha ao criar Mutex de Inventario!\n");
-        lcd_update_line(0, "ERRO FATAL");
-        lcd_update_line(1, "MUTEX INV. FALHOU");
-        while(true);
-    }
+    lcd_fb_init();
+    lcd_update_line(0, "Iniciando...");
+    lcd_update_line(1, "v1.0");
+
+    // --- PROTECAO DO INVENTARIO (lido tambem pelo nucleo 1) ---
+    critical_section_init(&g_inventory_cs);
     // Inicializa o inventario como vazio
     for (int i = 0; i < 6; i++) {
         g_cell_uids[i][0] = '\0';
     }
 
+    // Calcula o ETag da pagina HTML antes de subir a rede
+    http_assets_init();
+    critical_section_init(&g_event_cs);
+    g_log_lock = spin_lock_init(spin_lock_claim_unused(true));
+    flog_init();
+    uplink_hwm_init();
+
     multicore_launch_core1(core1_polling);
 
     // --- INICIALIZA RFID ---
     // (Assume que os pinos SPI, CS, RST estao definidos em lib/mfrc522.h)
-    printf("Inicializando leitor RFID MFRC522...\n");
+    PRINT_INFO(LOG_SUB_RFID, "Inicializando leitor RFID MFRC522...\n");
     lcd_update_line(1, "Iniciando RFID...");
     
     g_mfrc = MFRC522_Init();
     PCD_Init(g_mfrc, spi0); // Usa spi0 como no seu exemplo
     
-    printf("RFID MFRC522: ");
+    PRINT_INFO(LOG_SUB_RFID, "RFID MFRC522: ");
     PCD_DumpVersionToSerial(g_mfrc); // Imprime a versao do firmware no console
     
     lcd_update_line(1, "RFID OK.");
@@ -374,13 +1006,11 @@ int main()
 
 
     inicializa_eletroima();
-    multicore_launch_core1(core1_polling);
-    start_http_server();
 
     // Cria a fila para 5 comandos de movimento
     g_movement_queue = xQueueCreate(5, sizeof(MovementCommand)); 
     if (g_movement_queue == NULL) {
-         printf("Falha ao criar a Fila de Movimento!\n");
+         PRINT_ERROR(LOG_SUB_MOTION, "Falha ao criar a Fila de Movimento!\n");
          lcd_update_line(0, "ERRO FATAL");
          lcd_update_line(1, "FILA MOV. FALHOU");
          while(true);
@@ -388,8 +1018,13 @@ int main()
 
     // --- Tasks do FreeRTOS ---
     xTaskCreate(vMotorControlTask, "Motor Task", 1024, NULL, 3, NULL); // Prioridade alta
+    xTaskCreate(vLogFlushTask, "Log Flush Task", 1024, NULL, 1, NULL); // Apenas com a maquina parada
+    // Acima da task do motor: o laco de passos espera com sleep_us (menos que um tick) e
+    // nunca bloqueia, entao so uma task de prioridade maior desenha durante o movimento.
+    // Cada despertar custa pouco (so o que mudou, via DMA) e pausa os passos por instantes.
+    xTaskCreate(vLcdTask, "LCD Task", 512, NULL, 4, &g_lcd_task);
 
-    printf("Iniciando Scheduler do FreeRTOS...\n");
+    PRINT_INFO(LOG_SUB_SYS, "Iniciando Scheduler do FreeRTOS...\n");
     vTaskStartScheduler();
     
     panic_unsupported();
@@ -399,47 +1034,308 @@ int main()
 
 // -------------------- Funcoes Servidor HTTP --------------------
 
-#define CHUNK_SIZE 1024
-
-// Funcao para enviar o proximo pedaco de resposta se houver espaco na janela
+// Funcao para enfileirar o maximo possivel da resposta no buffer de envio disponivel
+// (respostas grandes: apenas a cota da conexao, ver http_bulk_allowance)
 static void send_next_chunk(struct tcp_pcb *tpcb, struct http_state *hs)
 {
-    if (hs->offset >= hs->len)
-        return;
-    size_t remaining = hs->len - hs->offset;
-    size_t to_send = remaining > CHUNK_SIZE ? CHUNK_SIZE : remaining;
-    if (tcp_sndbuf(tpcb) < to_send)
-        return; // Aguardar janela
-    err_t err = tcp_write(tpcb, hs->response_ptr + hs->offset, to_send, TCP_WRITE_FLAG_COPY);
-    if (err == ERR_OK)
-    {
-        hs->offset += to_send;
+    size_t limit = hs->bulk ? http_bulk_allowance(hs) : SIZE_MAX;
+    bool queued = false;
+    while (limit > 0)
+    {
+        // Cabecalho primeiro, depois o corpo (fixo ou gerado)
+        const char *src;
+        size_t remaining;
+        bool from_gen = false;
+        bool more_after = false;        // ha mais dados logo apos este trecho
+        u8_t flags = TCP_WRITE_FLAG_COPY;
+        if (hs->offset < hs->hdr_len)
+        {
+            src = hs->hdrbuf + hs->offset;
+            remaining = hs->hdr_len - hs->offset;
+            more_after = hs->body_len > 0 || hs->body_gen;
+        }
+        else if (hs->body_gen)
+        {
+            // Gera o proximo pedaco quando o anterior ja foi enfileirado (copiado pelo lwIP)
+            if (hs->gen_off >= hs->gen_len)
+            {
+                if (hs->gen_done)
+                    break;
+                hs->gen_len = http_gen_fill(hs);
+                hs->gen_off = 0;
+                if (hs->gen_len == 0)
+                    break;
+            }
+            src = hs->smallbuf + hs->gen_off;
+            remaining = hs->gen_len - hs->gen_off;
+            from_gen = true;
+        }
+        else
+        {
+            size_t total = hs->hdr_len + hs->body_len;
+            if (hs->offset >= total)
+                break;
+            src = hs->body_ptr + (hs->offset - hs->hdr_len);
+            remaining = total - hs->offset;
+            // Corpo constante (pagina em flash) e referenciado direto, sem copia
+            if (hs->body_static)
+                flags = 0;
+        }
+
+        // Ocupa o que couber na janela; o resto sai nos proximos http_sent
+        u16_t space = tcp_sndbuf(tpcb);
+        if (space == 0 || tcp_sndqueuelen(tpcb) >= TCP_SND_QUEUELEN)
+            break;
+        size_t n = remaining < space ? remaining : space;
+        if (n > limit)
+            n = limit;
+        // Com copia, o lwIP aloca o segmento inteiro no heap (MEM_SIZE): uma escrita grande
+        // falharia com ERR_MEM para sempre. Um MSS por tcp_write; o laco continua o resto.
+        if ((flags & TCP_WRITE_FLAG_COPY) && n > TCP_MSS)
+            n = TCP_MSS;
+        if (n < remaining || more_after)
+            flags |= TCP_WRITE_FLAG_MORE;
+
+        err_t err = tcp_write(tpcb, src, (u16_t)n, flags);
+        if (err != ERR_OK)
+        {
+            // ERR_MEM: sem segmentos livres agora, retoma no http_sent/http_poll
+            if (err != ERR_MEM)
+                PRINT_ERROR(LOG_SUB_HTTP, "tcp_write fatal: %d\n", err);
+            break;
+        }
+        hs->offset += n;
+        limit -= n;
+        if (from_gen)
+            hs->gen_off += n;
+        queued = true;
+    }
+    if (queued)
         tcp_output(tpcb);
+}
+
+// Quanto uma resposta grande ainda pode enfileirar: limitado pelos bytes sem ACK da
+// propria conexao e pela soma de todas as respostas grandes em envio
+static size_t http_bulk_allowance(const struct http_state *hs)
+{
+    size_t own = hs->offset - hs->sent;
+    if (own >= HTTP_BULK_INFLIGHT)
+        return 0;
+    size_t total = 0;
+    for (int i = 0; i < HTTP_MAX_CONNS; i++) {
+        const struct http_state *c = g_http_conns[i];
+        if (c && c->busy && c->bulk)
+            total += c->offset - c->sent;
+    }
+    if (total >= HTTP_BULK_INFLIGHT_TOTAL)
+        return 0;
+    size_t allow = HTTP_BULK_INFLIGHT - own;
+    return allow < HTTP_BULK_INFLIGHT_TOTAL - total ? allow : HTTP_BULK_INFLIGHT_TOTAL - total;
+}
+
+// Distribui o espaco de envio entre as conexoes: primeiro as respostas pequenas que
+// ficaram sem memoria no lwIP, depois as grandes em rodizio, cada uma com sua cota
+static void http_schedule(void)
+{
+    static uint8_t next = 0;
+    for (int i = 0; i < HTTP_MAX_CONNS; i++) {
+        struct http_state *c = g_http_conns[i];
+        if (c && c->busy && !c->bulk && !c->body_gen && c->offset < c->hdr_len + c->body_len)
+            send_next_chunk(c->pcb, c);
+    }
+    for (int k = 0; k < HTTP_MAX_CONNS; k++) {
+        struct http_state *c = g_http_conns[(next + k) % HTTP_MAX_CONNS];
+        if (c && c->busy && c->bulk)
+            send_next_chunk(c->pcb, c);
+    }
+    next = (next + 1) % HTTP_MAX_CONNS; // a proxima passada comeca pela conexao seguinte
+}
+
+// Gera o proximo pedaco do corpo em smallbuf. Com chunked, o gerador escreve apos o
+// espaco do tamanho e o pedaco recebe o enquadramento (e o terminador, se for o ultimo).
+static size_t http_gen_fill(struct http_state *hs)
+{
+    if (!hs->chunked)
+        return hs->body_gen(hs, hs->smallbuf, sizeof(hs->smallbuf));
+
+    char *buf = hs->smallbuf;
+    size_t n = hs->body_gen(hs, buf + HTTP_CHUNK_PREFIX,
+                            sizeof(hs->smallbuf) - HTTP_CHUNK_PREFIX - HTTP_CHUNK_SUFFIX);
+    size_t off = 0;
+    if (n > 0)
+    {
+        // Tamanho com largura fixa (zeros a esquerda sao validos): o gerador nao precisa mover os dados
+        char size_hex[HTTP_CHUNK_PREFIX + 1];
+        snprintf(size_hex, sizeof(size_hex), "%03x\r\n", (unsigned)n);
+        memcpy(buf, size_hex, HTTP_CHUNK_PREFIX);
+        off = HTTP_CHUNK_PREFIX + n;
+        memcpy(buf + off, "\r\n", 2);
+        off += 2;
+    }
+    else if (!hs->gen_done)
+    {
+        return 0; // nada novo por enquanto (pedaco vazio encerraria o corpo)
     }
-    else if (err != ERR_MEM)
+    if (hs->gen_done)
     {
-        // log erro irreversivel
-        printf("tcp_write fatal: %d\n", err);
+        memcpy(buf + off, "0\r\n\r\n", 5);
+        off += 5;
     }
+    return off;
 }
 
 // Funcao de callback para enviar dados HTTP
 static err_t http_sent(void *arg, struct tcp_pcb *tpcb, u16_t len)
 {
     struct http_state *hs = (struct http_state *)arg;
+    if (!hs)
+        return ERR_OK;
+
     hs->sent += len;
-    if (hs->sent >= hs->len)
+    hs->idle_ticks = 0;
+    hs->stall_ticks = 0;
+    if (!http_response_done(hs))
     {
-        tcp_close(tpcb);
-        free(hs);
+        if (hs->bulk)
+        {
+            // O ACK liberou cota: o escalonador reparte entre as respostas grandes
+            http_schedule();
+            return ERR_OK;
+        }
+        send_next_chunk(tpcb, hs);
+        // WebSocket: frames recebidos podem estar esperando espaco para as respostas
+        if (hs->ws && hs->rx_pbuf)
+            ws_process_pending(tpcb, hs);
+        return ERR_OK;
+    }
+
+    // Resposta completa: fecha ou segue para a proxima requisicao da conexao
+    // (se o cliente ja fechou o lado dele, so as requisicoes que ja chegaram sao atendidas)
+    err_t err;
+    if (!hs->keep_alive)
+    {
+        err = http_close(tpcb, hs);
     }
     else
     {
+        hs->busy = false;
+        err = http_process_pending(tpcb, hs);
+        if (err == ERR_OK && !hs->busy && hs->peer_closed)
+            err = http_close(tpcb, hs);
+    }
+    // A cota da resposta terminada fica para as demais conexoes
+    http_schedule();
+    return err;
+}
+
+// Resposta completa: tudo enfileirado (e gerado, se for o caso) ja foi confirmado
+static bool http_response_done(const struct http_state *hs)
+{
+    if (hs->body_gen)
+        return hs->gen_done && hs->gen_off >= hs->gen_len && hs->sent >= hs->offset;
+    return hs->sent >= hs->hdr_len + hs->body_len;
+}
+
+// Funcao de callback chamada periodicamente pelo lwIP (a cada HTTP_POLL_INTERVAL)
+static err_t http_poll(void *arg, struct tcp_pcb *tpcb)
+{
+    struct http_state *hs = (struct http_state *)arg;
+    if (!hs)
+        return ERR_OK;
+
+    if (hs->busy)
+    {
+        // Stream SSE: comentario periodico para manter a conexao viva
+        if (hs->sse && ++hs->sse_ping_ticks >= SSE_PING_TICKS)
+        {
+            hs->sse_ping_ticks = 0;
+            hs->sse_ping = true;
+        }
+        // Cliente lento: dados enfileirados sem nenhum ACK ha tempo demais
+        if (hs->offset > hs->sent && ++hs->stall_ticks >= HTTP_SEND_TIMEOUT_TICKS)
+        {
+            PRINT_WARN(LOG_SUB_HTTP, "HTTP: cliente lento, conexao abortada\n");
+            g_http_stats.evicted++;
+            return http_abort(tpcb, hs);
+        }
+        // Retoma um envio que parou por falta de memoria no lwIP (e encerra esperas vencidas
+        // de /api/history?wait=)
         send_next_chunk(tpcb, hs);
+        return ERR_OK;
+    }
+
+    // Requisicao chegando aos poucos por tempo demais (ex: headers a conta-gotas): fecha
+    if ((hs->req.state != HP_METHOD || hs->req.method_len) && ++hs->req_ticks >= HTTP_REQUEST_TIMEOUT_TICKS)
+    {
+        g_http_stats.evicted++;
+        return http_close(tpcb, hs);
+    }
+
+    // Conexao ociosa (keep-alive) por tempo demais: fecha
+    if (++hs->idle_ticks >= HTTP_IDLE_TIMEOUT_TICKS)
+        return http_close(tpcb, hs);
+    return ERR_OK;
+}
+
+// Fecha a conexao e libera o estado (retorna ERR_ABRT se precisou abortar)
+static err_t http_close(struct tcp_pcb *tpcb, struct http_state *hs)
+{
+    tcp_arg(tpcb, NULL);
+    tcp_recv(tpcb, NULL);
+    tcp_sent(tpcb, NULL);
+    tcp_poll(tpcb, NULL, 0);
+    tcp_err(tpcb, NULL);
+    if (hs)
+        http_free_state(hs);
+
+    if (tcp_close(tpcb) != ERR_OK)
+    {
+        tcp_abort(tpcb);
+        return ERR_ABRT;
     }
     return ERR_OK;
 }
 
+// Derruba a conexao com RST (libera o PCB na hora) e o estado
+static err_t http_abort(struct tcp_pcb *tpcb, struct http_state *hs)
+{
+    tcp_arg(tpcb, NULL);
+    tcp_recv(tpcb, NULL);
+    tcp_sent(tpcb, NULL);
+    tcp_poll(tpcb, NULL, 0);
+    tcp_err(tpcb, NULL);
+    if (hs)
+        http_free_state(hs);
+    tcp_abort(tpcb);
+    return ERR_ABRT;
+}
+
+// Conexao perdida (RST, timeout, falta de memoria): o PCB ja foi liberado pelo lwIP
+static void http_err(void *arg, err_t err)
+{
+    struct http_state *hs = (struct http_state *)arg;
+    if (!hs)
+        return;
+    g_http_stats.errors++;
+    http_free_state(hs);
+}
+
+// Libera tudo o que a conexao usa (listas de clientes, cache, pbufs e o proprio estado)
+static void http_free_state(struct http_state *hs)
+{
+    if (hs->sse)
+        sse_unregister(hs);
+    if (hs->ws)
+        ws_unregister(hs);
+    http_cache_release(hs);
+    if (hs->rx_pbuf)
+        pbuf_free(hs->rx_pbuf);
+    for (int i = 0; i < HTTP_MAX_CONNS; i++) {
+        if (g_http_conns[i] == hs) g_http_conns[i] = NULL;
+    }
+    free(hs);
+}
+
 // Funcao para escanear por um cartao RFID e obter sua UID
 static bool scan_for_uid(char* uid_buffer, size_t buffer_len) {
     if (g_mfrc == NULL) return false;
@@ -473,254 +1369,1933 @@ static bool scan_for_uid(char* uid_buffer, size_t buffer_len) {
 // Funcao de callback para receber dados HTTP
 static err_t http_recv(void *arg, struct tcp_pcb *tpcb, struct pbuf *p, err_t err)
 {
+    struct http_state *hs = (struct http_state *)arg;
     if (!p)
     {
-        tcp_close(tpcb);
+        // Cliente fechou o lado dele (half-close): a resposta em andamento ainda e entregue
+        // e a conexao fecha em http_sent. SSE e WebSocket nao terminam sozinhos: fecha ja.
+        if (!hs || !hs->busy || hs->sse || hs->ws)
+            return http_close(tpcb, hs);
+        hs->peer_closed = true;
         return ERR_OK;
     }
-    tcp_recved(tpcb, p->tot_len);
-
-    #define REQ_BUF_SZ 2048
-    char reqbuf[REQ_BUF_SZ];
-    size_t tocopy = p->tot_len < (REQ_BUF_SZ - 1) ? p->tot_len : (REQ_BUF_SZ - 1);
-    size_t copied = 0;
-    struct pbuf *q;
-    for (q = p; q != NULL && copied < tocopy; q = q->next)
-    {
-        size_t chunk = q->len;
-        if (chunk > tocopy - copied)
-            chunk = tocopy - copied;
-        memcpy(reqbuf + copied, q->payload, chunk);
-        copied += chunk;
-    }
-    reqbuf[copied] = '\0';
-    char *req = reqbuf;
-
-    struct http_state *hs = malloc(sizeof(struct http_state));
     if (!hs)
     {
+        tcp_recved(tpcb, p->tot_len);
         pbuf_free(p);
-        tcp_close(tpcb);
-        return ERR_MEM;
+        return ERR_OK;
     }
-    hs->sent = 0;
-    hs->offset = 0;
-    hs->using_smallbuf = false;
-    hs->response_ptr = NULL;
 
-    // PROCESSAMENTO DAS ROTAS HTTP
-    if (strstr(req, "GET /api/log?"))
-    hs->using_smallbuf = false;
-    hs->response_ptr = NULL;
+    // Encadeia os pbufs sem copiar; o parser consome conforme pode responder.
+    // A janela TCP so e liberada (tcp_recved) quando os bytes sao consumidos.
+    if (hs->rx_pbuf)
+        pbuf_cat(hs->rx_pbuf, p);
+    else
+        hs->rx_pbuf = p;
+    hs->idle_ticks = 0;
+
+    return http_process_pending(tpcb, hs);
+}
 
-    // PROCESSAMENTO DAS ROTAS HTTP
-    if (strstr(req, "GET /api/log?"))
+// Alimenta o parser com os pbufs recebidos e responde uma requisicao por vez
+static err_t http_process_pending(struct tcp_pcb *tpcb, struct http_state *hs)
+{
+    if (hs->ws)
     {
-        char msg[256];
-        if (query_param(req, "msg", msg, sizeof(msg)))
-        {
-            log_push("%s", msg);
-        }
-        hs->using_smallbuf = true;
-        hs->len = snprintf(hs->smallbuf, sizeof(hs->smallbuf), "HTTP/1.1 204 No Content\r\nConnection: close\r\n\r\n");
-        hs->response_ptr = hs->smallbuf;
+        ws_process_pending(tpcb, hs);
+        return ERR_OK;
     }
-    else if (strstr(req, "GET /api/history"))
+
+    while (!hs->busy)
     {
-        size_t off = 0;
-        off += snprintf(hs->smallbuf + off, sizeof(hs->smallbuf) - off,
-                        "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nConnection: close\r\n\r\n[");
-        for (int i = 0; i < g_log_count; i++)
+        struct http_request *req = &hs->req;
+
+        // Consome os pbufs ate completar uma requisicao (o resto fica para a proxima)
+        while (hs->rx_pbuf && req->state != HP_DONE && req->state != HP_ERROR)
         {
-            const char *ln = log_get(i);
-            char esc[LOG_LINE_MAX * 2];
-            size_t j = 0;
-            for (size_t k = 0; k < strlen(ln) && j + 2 < sizeof(esc); k++)
+            struct pbuf *q = hs->rx_pbuf;
+            if (q->len == 0)
             {
-                if (ln[k] == '"' || ln[k] == '\\')
-                {
-                    esc[j++] = '\\';
-                    esc[j++] = ln[k];
-                }
-                else if ((unsigned char)ln[k] < 0x20)
-                {
-                    esc[j++] = ' ';
-                }
-                else
-                {
-                    esc[j++] = ln[k];
-                }
+                // pbuf vazio no meio da cadeia: apenas descarta
+                hs->rx_pbuf = q->next;
+                q->next = NULL;
+                pbuf_free(q);
+                continue;
             }
-            esc[j] = '\0';
-            off += snprintf(hs->smallbuf + off, sizeof(hs->smallbuf) - off,
-                            "%s\"%s\"", (i ? "," : ""), esc);
-            if (off >= sizeof(hs->smallbuf) - 4)
-                break;
+            size_t used = http_parser_feed(req, (const char *)q->payload, q->len);
+            tcp_recved(tpcb, used);
+            hs->rx_pbuf = pbuf_free_header(q, used);
+        }
+        if (req->state != HP_DONE && req->state != HP_ERROR)
+            return ERR_OK; // Aguarda mais dados
+
+        hs->requests++;
+        hs->req_ticks = 0;
+        http_cache_release(hs);
+        hs->hdr_len = 0;
+        hs->body_ptr = NULL;
+        hs->body_len = 0;
+        hs->body_static = false;
+        hs->retry_after = 0;
+        hs->body_gen = NULL;
+        hs->gen_len = 0;
+        hs->gen_off = 0;
+        hs->gen_done = false;
+        hs->chunked = false;
+        hs->sent = 0;
+        hs->offset = 0;
+        if (req->state == HP_ERROR)
+        {
+            // Requisicao invalida: responde o erro e fecha a conexao
+            PRINT_WARN(LOG_SUB_HTTP, "HTTP: requisicao rejeitada (%s)\n", req->error_status);
+            hs->keep_alive = false;
+            http_finish_response(hs, req->error_status, NULL, NULL);
+        }
+        else
+        {
+            hs->keep_alive = http_wants_keep_alive(req) && hs->requests < HTTP_KEEPALIVE_MAX;
+            http_handle_request(hs, req);
+        }
+        http_parser_reset(req);
+
+        // Pagina, historico e demais corpos grandes entram no rodizio do escalonador;
+        // respostas pequenas, SSE e WebSocket saem sem cota
+        hs->bulk = !hs->ws && !hs->sse &&
+                   (hs->body_gen || hs->hdr_len + hs->body_len > HTTP_PRIORITY_MAX);
+        hs->busy = true;
+        send_next_chunk(tpcb, hs);
+
+        // Handshake aceito: o restante da conexao sao frames WebSocket
+        if (hs->ws)
+        {
+            ws_process_pending(tpcb, hs);
+            return ERR_OK;
         }
-        off += snprintf(hs->smallbuf + off, sizeof(hs->smallbuf) - off, "]");
-        hs->len = off;
-        hs->response_ptr = hs->smallbuf;
-        hs->using_smallbuf = true;
     }
-    else if (strstr(req, "POST /store?"))
+    return ERR_OK;
+}
+
+// Prepara o parser para a proxima requisicao da conexao
+static void http_parser_reset(struct http_request *r)
+{
+    r->state = HP_METHOD;
+    r->method_len = r->path_len = r->version_len = 0;
+    r->query_len = 0;
+    r->hname_len = r->hvalue_len = 0;
+    r->method[0] = r->path[0] = r->query[0] = r->version[0] = '\0';
+    r->if_none_match[0] = '\0';
+    r->upgrade_ws = false;
+    r->ws_key[0] = '\0';
+    r->conn_close = r->conn_keep_alive = false;
+    r->content_length = 0;
+    r->body_len = 0;
+    r->body[0] = '\0';
+    r->error_status = NULL;
+}
+
+// Consome bytes de um pedaco da requisicao; retorna quantos foram usados.
+// Para logo apos completar uma requisicao, deixando o resto (pipeline) intacto.
+static size_t http_parser_feed(struct http_request *r, const char *data, size_t len)
+{
+    size_t i = 0;
+    while (i < len && r->state != HP_DONE && r->state != HP_ERROR)
     {
-        // Processar armazenamento de pallet
-        char slot[10];
-        if (query_param(req, "slot", slot, sizeof(slot)))
+        // Corpo: copia em bloco direto do pbuf
+        if (r->state == HP_BODY)
         {
-            printf("Armazenamento solicitado - Slot: %s\n", slot);
-            log_push("Web: Pedido de ARMAZENAR no slot %s", slot);
-
-            int cell_index = slot_para_indice(slot);
-            if (cell_index != -1) {
-                MovementCommand cmd;
-                cmd.cell_index = cell_index;
-                cmd.is_store_operation = true; // true = guardar
-
-                // Envia o comando para a fila da task de motores
-                if (xQueueSend(g_movement_queue, &cmd, pdMS_TO_TICKS(100)) != pdTRUE) {
-                    log_push("ERRO: Fila de movimento esta cheia!");
-                    printf("ERRO: Fila de movimento cheia!\n");
-                }
-            } else {
-                log_push("ERRO: Slot invalido '%s' recebido da web.", slot);
-                printf("ERRO: Slot invalido '%s' da web.\n", slot);
+            size_t n = r->content_length - r->body_len;
+            if (n > len - i)
+                n = len - i;
+            memcpy(r->body + r->body_len, data + i, n);
+            r->body_len += n;
+            i += n;
+            if (r->body_len == r->content_length)
+            {
+                r->body[r->body_len] = '\0';
+                r->state = HP_DONE;
             }
+            continue;
         }
-        hs->using_smallbuf = true;
-        hs->len = snprintf(hs->smallbuf, sizeof(hs->smallbuf), "HTTP/1.1 200 OK\r\nConnection: close\r\n\r\n");
-        hs->response_ptr = hs->smallbuf;
-    }
-    else if (strstr(req, "POST /retrieve?"))
-    {
-        // Processar retirada de pallet
-        char slot[10];
-        if (query_param(req, "slot", slot, sizeof(slot)))
+
+        char c = data[i++];
+        switch (r->state)
         {
-            printf("Retirada solicitada - Slot: %s\n", slot);
-            log_push("Web: Pedido de RETIRAR do slot %s", slot);
-            
-            int cell_index = slot_para_indice(slot);
-            if (cell_index != -1) {
-                MovementCommand cmd;
-                cmd.cell_index = cell_index;
-                cmd.is_store_operation = false; // false = retirar
-
-                // Envia o comando para a fila da task de motores
-                if (xQueueSend(g_movement_queue, &cmd, pdMS_TO_TICKS(100)) != pdTRUE) {
-                    log_push("ERRO: Fila de movimento esta cheia!");
-                    printf("ERRO: Fila de movimento cheia!\n");
-                }
+        case HP_METHOD:
+            if (c == ' ') {
+                r->method[r->method_len] = '\0';
+                r->state = r->method_len ? HP_PATH : HP_ERROR;
+            } else if (c == '\r' || c == '\n') {
+                if (r->method_len) r->state = HP_ERROR; // linhas vazias antes da requisicao sao ignoradas
+            } else if (r->method_len + 1 < HTTP_METHOD_MAX) {
+                r->method[r->method_len++] = c;
+            } else {
+                r->state = HP_ERROR;
+            }
+            if (r->state == HP_ERROR) r->error_status = "400 Bad Request";
+            break;
+
+        case HP_PATH:
+            if (c == '?' || c == ' ') {
+                r->path[r->path_len] = '\0';
+                r->state = (c == '?') ? HP_QUERY : HP_VERSION;
+            } else if (c == '\r' || c == '\n') {
+                r->state = HP_ERROR;
+                r->error_status = "400 Bad Request";
+            } else if (r->path_len + 1 < HTTP_PATH_MAX) {
+                r->path[r->path_len++] = c;
             } else {
-                log_push("ERRO: Slot invalido '%s' recebido da web.", slot);
-                printf("ERRO: Slot invalido '%s' da web.\n", slot);
+                r->state = HP_ERROR;
+                r->error_status = "414 URI Too Long";
+            }
+            break;
+
+        case HP_QUERY:
+            if (c == ' ') {
+                r->query[r->query_len] = '\0';
+                r->state = HP_VERSION;
+            } else if (c == '\r' || c == '\n') {
+                r->state = HP_ERROR;
+                r->error_status = "400 Bad Request";
+            } else if (r->query_len + 1 < HTTP_QUERY_MAX) {
+                r->query[r->query_len++] = c;
+            } else {
+                r->state = HP_ERROR;
+                r->error_status = "414 URI Too Long";
+            }
+            break;
+
+        case HP_VERSION:
+            if (c == '\n') {
+                r->version[r->version_len] = '\0';
+                r->state = HP_HEADER_NAME;
+            } else if (c != '\r' && r->version_len + 1 < sizeof(r->version)) {
+                r->version[r->version_len++] = c;
+            }
+            break;
+
+        case HP_HEADER_NAME:
+            if (c == '\n' && r->hname_len == 0) {
+                // Linha vazia: fim dos headers
+                if (r->content_length == 0) {
+                    r->state = HP_DONE;
+                } else if (r->content_length > HTTP_BODY_MAX) {
+                    r->state = HP_ERROR;
+                    r->error_status = "413 Payload Too Large";
+                } else {
+                    r->state = HP_BODY;
+                }
+            } else if (c == ':') {
+                r->hname[r->hname_len] = '\0';
+                r->hvalue_len = 0;
+                r->state = HP_HEADER_VALUE;
+            } else if (c == '\n') {
+                r->hname_len = 0; // linha sem ':' e ignorada
+            } else if (c != '\r' && r->hname_len + 1 < HTTP_HNAME_MAX) {
+                r->hname[r->hname_len++] = c;
+            }
+            break;
+
+        case HP_HEADER_VALUE:
+            if (c == '\n') {
+                while (r->hvalue_len && (r->hvalue[r->hvalue_len - 1] == ' ' || r->hvalue[r->hvalue_len - 1] == '\t'))
+                    r->hvalue_len--;
+                r->hvalue[r->hvalue_len] = '\0';
+                http_parser_header(r);
+                r->hname_len = 0;
+                if (r->state == HP_HEADER_VALUE)
+                    r->state = HP_HEADER_NAME;
+            } else if (c == '\r' || ((c == ' ' || c == '\t') && r->hvalue_len == 0)) {
+                // ignora espacos iniciais e o '\r'
+            } else if (r->hvalue_len + 1 < HTTP_HVALUE_MAX) {
+                r->hvalue[r->hvalue_len++] = c;
             }
+            break;
+
+        default:
+            break;
         }
-        hs->using_smallbuf = true;
-        hs->len = snprintf(hs->smallbuf, sizeof(hs->smallbuf), "HTTP/1.1 200 OK\r\nConnection: close\r\n\r\n");
-        hs->response_ptr = hs->smallbuf;
     }
-    else if (strstr(req, "POST /toggle-electromagnet"))
+    return i;
+}
+
+// Guarda apenas os headers que o servidor usa
+static void http_parser_header(struct http_request *r)
+{
+    if (strcasecmp(r->hname, "Content-Length") == 0) {
+        r->content_length = strtoul(r->hvalue, NULL, 10);
+    } else if (strcasecmp(r->hname, "Connection") == 0) {
+        r->conn_close = strncasecmp(r->hvalue, "close", 5) == 0;
+        r->conn_keep_alive = strncasecmp(r->hvalue, "keep-alive", 10) == 0;
+    } else if (strcasecmp(r->hname, "If-None-Match") == 0) {
+        memcpy(r->if_none_match, r->hvalue, r->hvalue_len + 1);
+    } else if (strcasecmp(r->hname, "Upgrade") == 0) {
+        r->upgrade_ws = strncasecmp(r->hvalue, "websocket", 9) == 0;
+    } else if (strcasecmp(r->hname, "Sec-WebSocket-Key") == 0) {
+        snprintf(r->ws_key, sizeof(r->ws_key), "%s", r->hvalue);
+    } else if (strcasecmp(r->hname, "Transfer-Encoding") == 0) {
+        // Corpo chunked nao e suportado na requisicao
+        r->state = HP_ERROR;
+        r->error_status = "501 Not Implemented";
+    }
+}
+
+// Decide se a conexao continua aberta apos a resposta (HTTP/1.1 mantem por padrao)
+static bool http_wants_keep_alive(const struct http_request *req)
+{
+    if (req->conn_close)
+        return false;
+    if (req->conn_keep_alive)
+        return true;
+    return strcmp(req->version, "HTTP/1.1") == 0;
+}
+
+// Monta o cabecalho da resposta; o corpo (se houver) ja deve estar em body_ptr/body_len
+static void http_finish_response(struct http_state *hs, const char *status, const char *content_type, const char *etag)
+{
+    size_t off = snprintf(hs->hdrbuf, sizeof(hs->hdrbuf), "HTTP/1.1 %s\r\n", status);
+    if (content_type)
+        off += snprintf(hs->hdrbuf + off, sizeof(hs->hdrbuf) - off, "Content-Type: %s\r\n", content_type);
+    // Corpo gerado nao tem tamanho conhecido: vai em pedacos (chunked) e a conexao segue
+    // aberta; se o cliente nao mantem a conexao (HTTP/1.0, close), o fim do corpo e o fechamento
+    if (hs->body_gen)
     {
-        // Processar ativacao/desativacao do eletroima
-        toggle_eletroima();
-        printf("Eletroima alternado - Status: %s\n", electromagnet_active ? "Ativado" : "Desativado");
-        log_push("Eletroima %s", electromagnet_active ? "ativado" : "desativado");
-        
-        hs->using_smallbuf = true;
-        hs->len = snprintf(hs->smallbuf, sizeof(hs->smallbuf), "HTTP/1.1 200 OK\r\nConnection: close\r\n\r\n");
-        hs->response_ptr = hs->smallbuf;
+        hs->chunked = hs->keep_alive;
+        if (hs->chunked)
+            off += snprintf(hs->hdrbuf + off, sizeof(hs->hdrbuf) - off, "Transfer-Encoding: chunked\r\n");
     }
-    else if (strstr(req, "GET /api/electromagnet-status"))
+    // 204 e 304 nunca tem corpo
+    else if (strncmp(status, "204", 3) != 0 && strncmp(status, "304", 3) != 0)
+        off += snprintf(hs->hdrbuf + off, sizeof(hs->hdrbuf) - off, "Content-Length: %u\r\n", (unsigned)hs->body_len);
+    if (etag)
+        off += snprintf(hs->hdrbuf + off, sizeof(hs->hdrbuf) - off, "ETag: %s\r\n", etag);
+    if (hs->retry_after)
+        off += snprintf(hs->hdrbuf + off, sizeof(hs->hdrbuf) - off, "Retry-After: %u\r\n", hs->retry_after);
+    if (etag || hs->body_gen)
+        off += snprintf(hs->hdrbuf + off, sizeof(hs->hdrbuf) - off, "Cache-Control: no-cache\r\n");
+    if (hs->keep_alive)
+        off += snprintf(hs->hdrbuf + off, sizeof(hs->hdrbuf) - off,
+                        "Connection: keep-alive\r\nKeep-Alive: timeout=%d, max=%d\r\n\r\n",
+                        HTTP_IDLE_TIMEOUT_TICKS * HTTP_POLL_INTERVAL / 2, HTTP_KEEPALIVE_MAX);
+    else
+        off += snprintf(hs->hdrbuf + off, sizeof(hs->hdrbuf) - off, "Connection: close\r\n\r\n");
+    hs->hdr_len = off < sizeof(hs->hdrbuf) ? off : sizeof(hs->hdrbuf) - 1;
+}
+
+// -------------------- Rotas HTTP --------------------
+
+// Registra no log a mensagem recebida em ?msg=
+static void route_log_get(struct http_state *hs, const struct http_request *req)
+{
+    const char *msg = http_param(req, "msg");
+    if (msg)
     {
-        // Retorna o status atual do eletroima
-        hs->using_smallbuf = true;
-        hs->len = snprintf(hs->smallbuf, sizeof(hs->smallbuf), 
-                          "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nConnection: close\r\n\r\n{\"active\":%s}",
-                          electromagnet_active ? "true" : "false");
-        hs->response_ptr = hs->smallbuf;
+        LOG_INFO(LOG_SUB_HTTP, "%s", msg);
     }
-    else if (strstr(req, "POST /home"))
+    http_finish_response(hs, "204 No Content", NULL, NULL);
+}
+
+// Consulta (GET) ou altera (POST ?motion=debug&http=warn...) o nivel de cada subsistema.
+// Niveis abaixo de LOG_LEVEL aceitam o valor, mas essas chamadas nao estao no binario.
+static void route_log_level(struct http_state *hs, const struct http_request *req)
+{
+    if (strcmp(req->method, "POST") == 0)
     {
-        // Retorna os eixos ao ponto inicial (0,0,0)
-        printf("Comando de retorno ao home recebido.\n");
-        log_push("Web: Solicitacao de retorno ao home (0,0,0)");
-        
-        // Cria um comando especial para retornar ao home
-        // Usamos um indice negativo para indicar que e um comando de home
-        MovementCommand home_cmd;
-        home_cmd.cell_index = -1; // Codigo especial para home
-        home_cmd.is_store_operation = false;
-        
-        if (xQueueSend(g_movement_queue, &home_cmd, 0) == pdPASS) {
-            log_push("Comando de home enfileirado.");
-        } else {
-            log_push("ERRO: Fila de movimento cheia!");
+        for (int s = 0; s < LOG_SUB_COUNT; s++) {
+            const char *v = http_param(req, g_log_sub_names[s]);
+            if (!v) continue;
+            int lvl = -1;
+            for (int l = 0; l <= LOG_LVL_OFF; l++) {
+                if (strcasecmp(v, g_log_level_names[l]) == 0) lvl = l;
+            }
+            if (lvl < 0)
+            {
+                http_finish_response(hs, "400 Bad Request", NULL, NULL);
+                return;
+            }
+            g_log_levels[s] = (uint8_t)lvl;
         }
-        
-        hs->using_smallbuf = true;
-        hs->len = snprintf(hs->smallbuf, sizeof(hs->smallbuf), "HTTP/1.1 200 OK\r\nConnection: close\r\n\r\n");
-        hs->response_ptr = hs->smallbuf;
-    }
-    else
-    { // Rota padrao (pagina principal)
-        preencher_html();
-        hs->response_ptr = html; // apontar para buffer global
-        hs->len = strlen(html);
-        hs->using_smallbuf = false;
     }
 
-    tcp_arg(tpcb, hs);
-    tcp_sent(tpcb, http_sent);
-    send_next_chunk(tpcb, hs);
+    size_t off = snprintf(hs->smallbuf, sizeof(hs->smallbuf), "{\"compiled\":\"%s\",\"levels\":{",
+                          g_log_level_names[LOG_LEVEL]);
+    for (int s = 0; s < LOG_SUB_COUNT; s++) {
+        off += snprintf(hs->smallbuf + off, sizeof(hs->smallbuf) - off, "%s\"%s\":\"%s\"", s ? "," : "",
+                        g_log_sub_names[s], g_log_level_names[g_log_levels[s]]);
+    }
+    off += snprintf(hs->smallbuf + off, sizeof(hs->smallbuf) - off, "}}");
+    hs->body_ptr = hs->smallbuf;
+    hs->body_len = off;
+    http_finish_response(hs, "200 OK", "application/json", NULL);
+}
 
-    pbuf_free(p);
-    return ERR_OK;
+// Registra no log a mensagem enviada no corpo (texto puro)
+static void route_log_post(struct http_state *hs, const struct http_request *req)
+{
+    if (req->body_len > 0)
+    {
+        LOG_INFO(LOG_SUB_HTTP, "%s", req->body);
+    }
+    http_finish_response(hs, "204 No Content", NULL, NULL);
 }
 
-// Funcao de callback para aceitar novas conexoes TCP
-static err_t connection_callback(void *arg, struct tcp_pcb *newpcb, err_t err)
+// Le ?limit= de /api/history: ausente ou 0 vira o padrao, acima do maximo e cortado
+static uint32_t history_limit(const struct http_request *req, uint32_t def, uint32_t max)
 {
-    tcp_recv(newpcb, http_recv);
-    return ERR_OK;
+    const char *limit = http_param(req, "limit");
+    uint32_t n = limit ? strtoul(limit, NULL, 10) : 0;
+    if (n == 0)
+        n = def;
+    return n > max ? max : n;
 }
 
-// Funcao para iniciar o servidor HTTP
-static void start_http_server(void)
+// Registros no anel na ultima vez que o historico nao coube no cache (0 = nunca). O anel so
+// cresce ate LOG_CAP, entao com pelo menos isso o JSON vai direto para o envio por partes.
+static uint32_t g_history_cache_overflow = 0;
+
+// Retorna o historico de logs em JSON
+static void route_history(struct http_state *hs, const struct http_request *req)
 {
-    struct tcp_pcb *pcb = tcp_new();
-    if (!pcb)
+    const char *since = http_param(req, "since");
+
+    // ?flash=1&since=<seq>&limit=<n>: le o log persistente da flash a partir da seq
+    if (http_param(req, "flash"))
     {
-        printf("Erro ao criar PCB TCP\n");
+        uint32_t n = history_limit(req, FLOG_LIMIT_DEFAULT, FLOG_LIMIT_MAX);
+        uint32_t first = g_flog.oldest_seq;
+        uint32_t next = g_flog.next_seq;
+        uint32_t from = since ? strtoul(since, NULL, 10) : first;
+        if ((int32_t)(from - first) < 0)
+            from = first; // linhas mais antigas ja foram apagadas
+        if ((int32_t)(from - next) > 0)
+            from = next;
+        hs->gen_pos = from;
+        hs->gen_end = next - from > n ? from + n : next;
+        hs->gen_aux = first;
+        hs->gen_stage = 0;
+        hs->gen_count = 0;
+        hs->gen_done = false;
+        hs->body_gen = flog_json_gen;
+        http_finish_response(hs, "200 OK", "application/json", NULL);
         return;
     }
-    if (tcp_bind(pcb, IP_ADDR_ANY, 80) != ERR_OK)
+
+    // ?since=<seq>&limit=<n>&wait=<s>: so as linhas em RAM a partir de seq; sem nenhuma,
+    // o corpo fica retido ate chegar uma linha ou vencer a espera (history_delta_gen)
+    if (since)
     {
-        printf("Erro ao ligar o servidor na porta 80\n");
+        uint32_t n = history_limit(req, HISTORY_LIMIT_DEFAULT, HISTORY_LIMIT_MAX);
+        const char *wait = http_param(req, "wait");
+        uint32_t wait_s = wait ? strtoul(wait, NULL, 10) : 0;
+        if (wait_s > HISTORY_WAIT_MAX_S)
+            wait_s = HISTORY_WAIT_MAX_S;
+        uint32_t from = strtoul(since, NULL, 10);
+        if ((int32_t)(from - g_log_seq) > 0)
+        {
+            from = g_log_seq - log_count(); // seq de antes de um reinicio: recomeca do inicio
+            wait_s = 0;
+        }
+        hs->gen_pos = from;
+        hs->gen_end = n; // vira o fim do intervalo quando o corpo comeca
+        hs->gen_aux = to_ms_since_boot(get_absolute_time()) + wait_s * 1000;
+        hs->gen_stage = 0;
+        hs->gen_count = 0;
+        hs->gen_done = false;
+        hs->body_gen = history_delta_gen;
+        http_finish_response(hs, "200 OK", "application/json", NULL);
         return;
     }
-    pcb = tcp_listen(pcb);
-    tcp_accept(pcb, connection_callback);
-    printf("Servidor HTTP rodando na porta 80...\n");
-}
 
-// Simples utilitarios para parsing de URL/query
-static int url_hex(char c) {
-    if (c >= '0' && c <= '9') return c - '0';
-    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
-    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
-    return -1;
+    // O ETag acompanha a versao do log: sem novas linhas, responde 304
+    uint32_t version = g_log_seq;
+    char etag[24];
+    http_make_etag(etag, sizeof(etag), 'l', version);
+    if (http_if_none_match(req, etag))
+    {
+        http_not_modified(hs, etag);
+        return;
+    }
+
+    uint32_t count = log_count();
+    hs->gen_stage = 0;
+    hs->gen_count = 0;
+    hs->gen_done = false;
+    hs->gen_end = version;
+    hs->gen_pos = hs->gen_end - count;
+
+    // Mesma versao do log: reaproveita o JSON ja montado
+    bool hit;
+    HttpCacheEntry *e = http_cache_lookup(CACHE_HISTORY, version, 0, &hit);
+    if (!hit && e && (g_history_cache_overflow == 0 || count < g_history_cache_overflow))
+    {
+        // Monta o JSON inteiro no cache; se nao couber, gera por partes no envio e lembra
+        // o tamanho do anel para nao repetir a tentativa nas proximas requisicoes
+        e->len = history_json_gen(hs, e->data, e->cap);
+        e->valid = hs->gen_done;
+        if (!e->valid)
+            g_history_cache_overflow = count;
+        hit = e->valid;
+    }
+    if (hit)
+    {
+        http_cache_serve(hs, e);
+        http_finish_response(hs, "200 OK", "application/json", etag);
+        return;
+    }
+
+    // O JSON e gerado por partes enquanto e enviado (history_json_gen)
+    hs->gen_stage = 0;
+    hs->gen_count = 0;
+    hs->gen_done = false;
+    hs->gen_pos = hs->gen_end - log_count();
+    hs->body_gen = history_json_gen;
+    http_finish_response(hs, "200 OK", "application/json", etag);
 }
 
-// Decodifica URL inplace (modifica a string original)
-static void url_decode_inplace(char *s) {
-    char *w = s;
-    while (*s) {
-        if (*s == '+') { *w++ = ' '; s++; }
-        else if (*s == '%' && isxdigit((unsigned char)s[1]) && isxdigit((unsigned char)s[2])) {
-            int hi = url_hex(s[1]);
-            int lo = url_hex(s[2]);
-            if (hi >= 0 && lo >= 0) {
+// Gera o array JSON do historico por partes, apenas com as linhas que cabem em buf
+static size_t history_json_gen(struct http_state *hs, char *buf, size_t cap)
+{
+    size_t off = 0;
+    if (hs->gen_stage == 0)
+    {
+        buf[off++] = '[';
+        hs->gen_stage = 1;
+    }
+
+    while (hs->gen_stage == 1 && hs->gen_pos != hs->gen_end)
+    {
+        char ln[LOG_LINE_MAX];
+        if (!log_read_seq(hs->gen_pos, ln, sizeof(ln), NULL))
+        {
+            hs->gen_pos++; // linha sobrescrita durante o envio
+            continue;
+        }
+        char esc[LOG_LINE_MAX * 2];
+        size_t n = json_escape(esc, sizeof(esc), ln);
+        size_t need = n + 2 + (hs->gen_count ? 1 : 0);
+        if (off + need > cap)
+            return off; // continua no proximo pedaco
+        if (hs->gen_count)
+            buf[off++] = ',';
+        buf[off++] = '"';
+        memcpy(buf + off, esc, n);
+        off += n;
+        buf[off++] = '"';
+        hs->gen_count++;
+        hs->gen_pos++;
+    }
+
+    if (off + 1 <= cap)
+    {
+        buf[off++] = ']';
+        hs->gen_done = true;
+    }
+    else
+    {
+        hs->gen_stage = 2;
+    }
+    return off;
+}
+
+// Gera {"first":F,"next":N,"lines":[{"seq":S,"ts":T,"level":"INFO","msg":"..."},...]} com as
+// linhas em RAM a partir de gen_pos. Retorna 0 (corpo retido) enquanto nao ha linha nova e o
+// prazo em gen_aux nao venceu; stream_pump e http_poll chamam de novo.
+static size_t history_delta_gen(struct http_state *hs, char *buf, size_t cap)
+{
+    size_t off = 0;
+    if (hs->gen_stage == 0)
+    {
+        uint32_t log_seq = g_log_seq;
+        if (hs->gen_pos == log_seq && (int32_t)(to_ms_since_boot(get_absolute_time()) - hs->gen_aux) < 0)
+            return 0;
+        uint32_t first = log_seq - log_count();
+        if (log_seq - hs->gen_pos > log_count())
+            hs->gen_pos = first; // linhas pedidas ja foram sobrescritas
+        uint32_t n = hs->gen_end;
+        hs->gen_end = log_seq - hs->gen_pos > n ? hs->gen_pos + n : log_seq;
+        off += snprintf(buf, cap, "{\"first\":%lu,\"next\":%lu,\"lines\":[",
+                        (unsigned long)first, (unsigned long)hs->gen_end);
+        hs->gen_stage = 1;
+    }
+
+    while (hs->gen_stage == 1 && hs->gen_pos != hs->gen_end)
+    {
+        char ln[LOG_LINE_MAX];
+        LogMeta meta;
+        if (!log_read_seq(hs->gen_pos, ln, sizeof(ln), &meta))
+        {
+            hs->gen_pos++; // continuacao ou linha sobrescrita durante o envio
+            continue;
+        }
+        char esc[LOG_LINE_MAX * 2];
+        json_escape(esc, sizeof(esc), ln);
+        int n = snprintf(buf + off, cap - off, "%s{\"seq\":%lu,\"ts\":%lu,\"level\":\"%s\",\"msg\":\"%s\"}",
+                         hs->gen_count ? "," : "", (unsigned long)hs->gen_pos, (unsigned long)meta.ts_ms,
+                         g_log_level_names[meta.level], esc);
+        if (n < 0 || (size_t)n >= cap - off)
+            return off; // continua no proximo pedaco
+        off += n;
+        hs->gen_count++;
+        hs->gen_pos++;
+    }
+
+    if (off + 2 <= cap)
+    {
+        memcpy(buf + off, "]}", 2);
+        off += 2;
+        hs->gen_done = true;
+    }
+    else
+    {
+        hs->gen_stage = 2;
+    }
+    return off;
+}
+
+// Clientes inscritos em /api/events
+static struct http_state *g_sse_clients[SSE_MAX_CLIENTS];
+
+// Abre o stream de Server-Sent Events com o estado da maquina
+static void route_events(struct http_state *hs, const struct http_request *req)
+{
+    int slot = -1;
+    for (int i = 0; i < SSE_MAX_CLIENTS; i++) {
+        if (!g_sse_clients[i]) { slot = i; break; }
+    }
+    if (slot < 0)
+    {
+        http_finish_response(hs, "503 Service Unavailable", NULL, NULL);
+        return;
+    }
+    g_sse_clients[slot] = hs;
+
+    // Comeca a partir do estado atual: snapshot inicial + apenas novidades
+    hs->sse = true;
+    hs->sse_ping = false;
+    hs->sse_ping_ticks = 0;
+    hs->sse_event_seq = g_event_seq;
+    hs->sse_log_seq = g_log_seq;
+    hs->gen_stage = 0;
+    hs->body_gen = sse_event_gen;
+    http_finish_response(hs, "200 OK", "text/event-stream", NULL);
+    tcp_nagle_disable(hs->pcb); // eventos pequenos saem na hora
+}
+
+// Remove a conexao da lista de clientes SSE
+static void sse_unregister(struct http_state *hs)
+{
+    for (int i = 0; i < SSE_MAX_CLIENTS; i++) {
+        if (g_sse_clients[i] == hs) g_sse_clients[i] = NULL;
+    }
+    hs->sse = false;
+}
+
+// Gera os eventos SSE pendentes que cabem em buf (0 = nada novo por enquanto)
+static size_t sse_event_gen(struct http_state *hs, char *buf, size_t cap)
+{
+    size_t off = 0;
+    int n;
+
+    if (hs->gen_stage == 0)
+    {
+        // Intervalo de reconexao + snapshot do estado atual
+        off += snprintf(buf, cap, "retry: 3000\n\nevent: state\ndata: ");
+        off += state_json(buf + off, cap - off - 2);
+        buf[off++] = '\n';
+        buf[off++] = '\n';
+        hs->gen_stage = 1;
+    }
+
+    if (hs->sse_ping)
+    {
+        n = snprintf(buf + off, cap - off, ": ping\n\n");
+        if (n > 0 && (size_t)n < cap - off)
+        {
+            off += n;
+            hs->sse_ping = false;
+        }
+    }
+
+    // Eventos de estado (job, posicao, inventario, eletroima)
+    DeviceEvent ev;
+    while (event_get(&hs->sse_event_seq, &ev))
+    {
+        n = snprintf(buf + off, cap - off, "event: %s\ndata: %s\n\n", ev.type, ev.data);
+        if (n < 0 || (size_t)n >= cap - off)
+            return off; // continua no proximo pedaco
+        off += n;
+        hs->sse_event_seq++;
+    }
+
+    // Novas linhas do log
+    uint32_t log_seq = g_log_seq;
+    if (log_seq - hs->sse_log_seq > log_count())
+        hs->sse_log_seq = log_seq - log_count(); // cliente atrasado: pula o que foi sobrescrito
+    while (hs->sse_log_seq != log_seq)
+    {
+        char ln[LOG_LINE_MAX];
+        if (log_read_seq(hs->sse_log_seq, ln, sizeof(ln), NULL))
+        {
+            char esc[LOG_LINE_MAX * 2];
+            json_escape(esc, sizeof(esc), ln);
+            n = snprintf(buf + off, cap - off, "event: log\ndata: \"%s\"\n\n", esc);
+            if (n < 0 || (size_t)n >= cap - off)
+                return off;
+            off += n;
+        }
+        hs->sse_log_seq++;
+    }
+    return off;
+}
+
+// Clientes conectados em /api/ws
+static struct http_state *g_ws_clients[WS_MAX_CLIENTS];
+
+// Chamado no loop do nucleo 1: acorda os streams SSE e WebSocket e as consultas de
+// historico em espera quando ha novidades. Roda fora do contexto do lwIP, entao os
+// envios (tcp_write/tcp_output) ficam entre cyw43_arch_lwip_begin/end.
+static void stream_pump(void)
+{
+    static uint32_t last_event_seq = 0;
+    static uint32_t last_log_seq = 0;
+    if (g_event_seq == last_event_seq && g_log_seq == last_log_seq)
+        return;
+    last_event_seq = g_event_seq;
+    last_log_seq = g_log_seq;
+
+    cyw43_arch_lwip_begin();
+
+    for (int i = 0; i < SSE_MAX_CLIENTS; i++) {
+        struct http_state *hs = g_sse_clients[i];
+        if (hs && hs->offset >= hs->hdr_len)
+            send_next_chunk(hs->pcb, hs);
+    }
+    for (int i = 0; i < WS_MAX_CLIENTS; i++) {
+        struct http_state *hs = g_ws_clients[i];
+        if (hs && hs->ws_event_seq != g_event_seq && hs->offset >= hs->hdr_len)
+            send_next_chunk(hs->pcb, hs);
+    }
+    for (int i = 0; i < HTTP_MAX_CONNS; i++) {
+        struct http_state *hs = g_http_conns[i];
+        if (hs && hs->busy && hs->body_gen == history_delta_gen && hs->gen_stage == 0 &&
+            hs->offset >= hs->hdr_len)
+            send_next_chunk(hs->pcb, hs);
+    }
+    m2m_pump();
+    cyw43_arch_lwip_end();
+}
+
+// Converte a conexao em WebSocket de controle (comandos e status em frames binarios)
+static void route_ws(struct http_state *hs, const struct http_request *req)
+{
+    if (!req->upgrade_ws || req->ws_key[0] == '\0')
+    {
+        http_finish_response(hs, "400 Bad Request", NULL, NULL);
+        return;
+    }
+    int slot = -1;
+    for (int i = 0; i < WS_MAX_CLIENTS; i++) {
+        if (!g_ws_clients[i]) { slot = i; break; }
+    }
+    if (slot < 0)
+    {
+        http_finish_response(hs, "503 Service Unavailable", NULL, NULL);
+        return;
+    }
+
+    // Sec-WebSocket-Accept = base64(sha1(chave + GUID do RFC 6455))
+    char key[sizeof(req->ws_key) + 40];
+    int klen = snprintf(key, sizeof(key), "%s258EAFA5-E914-47DA-95CA-C5AB0DC85B11", req->ws_key);
+    unsigned char digest[20];
+    unsigned char accept[32];
+    size_t alen = 0;
+    mbedtls_sha1((const unsigned char *)key, klen, digest);
+    mbedtls_base64_encode(accept, sizeof(accept) - 1, &alen, digest, sizeof(digest));
+    accept[alen] = '\0';
+
+    g_ws_clients[slot] = hs;
+    hs->ws = true;
+    hs->ws_status = true; // status inicial logo apos o handshake
+    hs->ws_closing = false;
+    hs->ws_event_seq = g_event_seq;
+    hs->ws_out_len = 0;
+    hs->keep_alive = false; // apos o frame de close a conexao e encerrada
+    hs->body_gen = ws_frame_gen;
+    hs->hdr_len = snprintf(hs->hdrbuf, sizeof(hs->hdrbuf),
+                           "HTTP/1.1 101 Switching Protocols\r\n"
+                           "Upgrade: websocket\r\n"
+                           "Connection: Upgrade\r\n"
+                           "Sec-WebSocket-Accept: %s\r\n\r\n", accept);
+    tcp_nagle_disable(hs->pcb); // comandos e status sao pequenos: sem atraso do Nagle
+    LOG_INFO(LOG_SUB_HTTP, "WS: cliente de controle conectado");
+}
+
+// Remove a conexao da lista de clientes WebSocket
+static void ws_unregister(struct http_state *hs)
+{
+    for (int i = 0; i < WS_MAX_CLIENTS; i++) {
+        if (g_ws_clients[i] == hs) g_ws_clients[i] = NULL;
+    }
+    hs->ws = false;
+}
+
+// Consome os frames completos recebidos; para se ainda nao ha espaco para as respostas
+static void ws_process_pending(struct tcp_pcb *tpcb, struct http_state *hs)
+{
+    while (hs->rx_pbuf && !hs->ws_closing)
+    {
+        uint8_t frame[2 + 4 + WS_PAYLOAD_MAX]; // cabecalho curto + mascara + payload
+        u16_t avail = hs->rx_pbuf->tot_len;
+        if (avail < 2)
+            break;
+        pbuf_copy_partial(hs->rx_pbuf, frame, 2, 0);
+
+        bool fin = frame[0] & 0x80;
+        uint8_t opcode = frame[0] & 0x0F;
+        bool masked = frame[1] & 0x80;
+        uint8_t plen = frame[1] & 0x7F;
+        if (!fin || !masked || plen > WS_PAYLOAD_MAX)
+        {
+            // Fragmentos, frames sem mascara ou longos (126/127) nao sao aceitos
+            ws_queue_close(hs, plen > WS_PAYLOAD_MAX ? 1009 : 1002);
+            break;
+        }
+        u16_t total = 2 + 4 + plen;
+        if (avail < total)
+            break; // aguarda o resto do frame
+
+        // A resposta (ack, pong ou close) precisa caber no buffer de saida
+        size_t need = (opcode == 0x9) ? 2 + plen : 9;
+        if (hs->ws_out_len + need > WS_OUT_MAX)
+            break; // retoma no http_sent
+
+        pbuf_copy_partial(hs->rx_pbuf, frame, total, 0);
+        tcp_recved(tpcb, total);
+        hs->rx_pbuf = pbuf_free_header(hs->rx_pbuf, total);
+
+        uint8_t *mask = frame + 2;
+        uint8_t *payload = frame + 6;
+        for (int i = 0; i < plen; i++)
+            payload[i] ^= mask[i & 3];
+
+        switch (opcode)
+        {
+        case 0x2: // binario: comando
+            ws_command(hs, payload, plen);
+            break;
+        case 0x8: // close: devolve o codigo recebido
+            ws_queue_close(hs, plen >= 2 ? (uint16_t)(payload[0] << 8 | payload[1]) : 1000);
+            break;
+        case 0x9: // ping
+            ws_queue_frame(hs, 0xA, payload, plen);
+            break;
+        case 0xA: // pong
+            break;
+        default: // texto e continuacao nao fazem parte do protocolo
+            ws_queue_close(hs, 1003);
+            break;
+        }
+    }
+
+    // Depois do close, o que chegar e descartado
+    if (hs->ws_closing && hs->rx_pbuf)
+    {
+        tcp_recved(tpcb, hs->rx_pbuf->tot_len);
+        pbuf_free(hs->rx_pbuf);
+        hs->rx_pbuf = NULL;
+    }
+    send_next_chunk(tpcb, hs);
+}
+
+// Executa um comando binario e responde com um ack [0x80, id, resultado, job u32]
+static void ws_command(struct http_state *hs, const uint8_t *p, size_t n)
+{
+    uint8_t id = n >= 2 ? p[1] : 0;
+    uint8_t result = CMD_ERR_INVALID;
+    MovementCommand cmd = {0};
+
+    switch (n >= 2 ? p[0] : 0)
+    {
+    case WS_CMD_STORE:
+    case WS_CMD_RETRIEVE:
+        if (n < 3 || p[2] >= 6)
+            break;
+        cmd.cell_index = p[2];
+        cmd.is_store_operation = p[0] == WS_CMD_STORE;
+        LOG_INFO(LOG_SUB_HTTP, "WS: Pedido de %s no slot %s", cmd.is_store_operation ? "ARMAZENAR" : "RETIRAR",
+                 indice_para_slot(p[2]));
+        result = job_submit(&cmd) ? CMD_OK : CMD_ERR_BUSY;
+        break;
+
+    case WS_CMD_HOME:
+        cmd.cell_index = -1;
+        LOG_INFO(LOG_SUB_HTTP, "WS: Solicitacao de retorno ao home (0,0,0)");
+        result = job_submit(&cmd) ? CMD_OK : CMD_ERR_BUSY;
+        break;
+
+    case WS_CMD_MAGNET:
+        if (n < 3 || p[2] > 2)
+            break;
+        if (p[2] == 2)
+            toggle_eletroima();
+        else if (p[2] == 1)
+            ativar_eletroima();
+        else
+            desativar_eletroima();
+        LOG_DEBUG(LOG_SUB_MOTION, "Eletroima %s", electromagnet_active ? "ativado" : "desativado");
+        result = CMD_OK;
+        break;
+
+    case WS_CMD_JOG:
+        if (n < 7 || p[2] > 2)
+            break;
+        cmd.cell_index = -2;
+        cmd.jog_axis = p[2];
+        cmd.jog_steps = (int32_t)((uint32_t)p[3] | (uint32_t)p[4] << 8 | (uint32_t)p[5] << 16 | (uint32_t)p[6] << 24);
+        result = job_submit(&cmd) ? CMD_OK : CMD_ERR_BUSY;
+        break;
+
+    case WS_CMD_STATUS:
+        hs->ws_status = true;
+        result = CMD_OK;
+        break;
+
+    default:
+        break;
+    }
+
+    uint8_t ack[7] = { WS_MSG_ACK, id, result };
+    put_i32_le(ack + 3, (int32_t)cmd.job_id);
+    ws_queue_frame(hs, 0x2, ack, sizeof(ack));
+}
+
+// Acrescenta um frame (sem mascara, payload < 126) ao buffer de saida
+static bool ws_queue_frame(struct http_state *hs, uint8_t opcode, const uint8_t *data, size_t len)
+{
+    if (hs->ws_out_len + 2 + len > WS_OUT_MAX)
+        return false;
+    hs->ws_out[hs->ws_out_len++] = 0x80 | opcode;
+    hs->ws_out[hs->ws_out_len++] = (uint8_t)len;
+    memcpy(hs->ws_out + hs->ws_out_len, data, len);
+    hs->ws_out_len += len;
+    return true;
+}
+
+// Enfileira o frame de close; a conexao fecha quando ele for confirmado. Sem espaco no
+// buffer de saida nada muda: o frame que causou o close continua em rx_pbuf e o
+// ws_process_pending tenta de novo quando o envio liberar espaco (http_sent)
+static void ws_queue_close(struct http_state *hs, uint16_t code)
+{
+    uint8_t payload[2] = { code >> 8, code & 0xFF };
+    if (ws_queue_frame(hs, 0x8, payload, sizeof(payload)))
+        hs->ws_closing = true;
+}
+
+// Gera os frames pendentes: respostas primeiro, depois o status se algo mudou
+static size_t ws_frame_gen(struct http_state *hs, char *buf, size_t cap)
+{
+    size_t off = 0;
+    if (hs->ws_out_len)
+    {
+        memcpy(buf, hs->ws_out, hs->ws_out_len);
+        off = hs->ws_out_len;
+        hs->ws_out_len = 0;
+    }
+    if (hs->ws_closing)
+    {
+        hs->gen_done = true; // o close foi o ultimo frame
+        return off;
+    }
+
+    if (hs->ws_status || hs->ws_event_seq != g_event_seq)
+    {
+        hs->ws_status = false;
+        hs->ws_event_seq = g_event_seq;
+
+        uint8_t *f = (uint8_t *)buf + off;
+        f[0] = 0x80 | 0x2;
+        f[1] = 1 + STATE_BIN_LEN;
+        f[2] = WS_MSG_STATUS;
+        off += 3 + state_binary(f + 3);
+    }
+    return off;
+}
+
+// Comandos aguardando na fila da task de motores
+static unsigned queue_depth(void)
+{
+    return g_movement_queue ? (unsigned)uxQueueMessagesWaiting(g_movement_queue) : 0;
+}
+
+// Estado atual da maquina em JSON (eletroima, posicao em mm, fila, job e inventario)
+static size_t state_json(char *buf, size_t cap)
+{
+    JobStatus job = job_snapshot();
+    size_t off = snprintf(buf, cap, "{\"magnet\":%s,\"x\":%.2f,\"y\":%.2f,\"z\":%.2f,\"queue\":%u,",
+                          electromagnet_active ? "true" : "false",
+                          g_current_steps_x / STEPS_PER_MM_X,
+                          g_current_steps_y / STEPS_PER_MM_Y,
+                          g_current_steps_z / STEPS_PER_MM_Z,
+                          queue_depth());
+    if (job.active && off < cap)
+        off += snprintf(buf + off, cap - off, "\"job\":{\"op\":\"%s\",\"slot\":\"%s\",\"phase\":\"%s\"},",
+                        job.op, job.cell >= 0 ? indice_para_slot(job.cell) : "", job.phase);
+    else if (off < cap)
+        off += snprintf(buf + off, cap - off, "\"job\":null,");
+    if (off < cap)
+        off += snprintf(buf + off, cap - off, "\"cells\":{");
+    char uids[6][UID_STRLEN];
+    inventory_snapshot(uids);
+    for (int i = 0; i < 6 && off < cap; i++) {
+        off += snprintf(buf + off, cap - off, "%s\"%s\":\"%s\"", i ? "," : "",
+                        indice_para_slot(i), uids[i]);
+    }
+    if (off < cap)
+        off += snprintf(buf + off, cap - off, "}}");
+    return off < cap ? off : cap - 1;
+}
+
+// Escreve um inteiro de 32 bits little-endian
+static void put_i32_le(uint8_t *p, int32_t v)
+{
+    p[0] = (uint8_t)(v & 0xFF);
+    p[1] = (uint8_t)((v >> 8) & 0xFF);
+    p[2] = (uint8_t)((v >> 16) & 0xFF);
+    p[3] = (uint8_t)((v >> 24) & 0xFF);
+}
+
+// Estado atual no layout binario (STATE_BIN_LEN bytes); retorna o tamanho escrito
+static size_t state_binary(uint8_t *out)
+{
+    JobStatus job = job_snapshot();
+
+    // Celulas ocupadas como mascara de bits (bit i = celula i)
+    uint8_t cells = 0;
+    critical_section_enter_blocking(&g_inventory_cs);
+    for (int i = 0; i < 6; i++) {
+        if (g_cell_uids[i][0] != '\0') cells |= 1u << i;
+    }
+    critical_section_exit(&g_inventory_cs);
+
+    uint8_t op = 0;
+    if (job.active) {
+        if (strcmp(job.op, "store") == 0) op = 1;
+        else if (strcmp(job.op, "retrieve") == 0) op = 2;
+        else if (strcmp(job.op, "home") == 0) op = 3;
+        else if (strcmp(job.op, "jog") == 0) op = 4;
+    }
+
+    out[0] = (electromagnet_active ? 0x01 : 0x00) | (job.active ? 0x02 : 0x00);
+    out[1] = (uint8_t)queue_depth();
+    out[2] = cells;
+    put_i32_le(out + 3, (int32_t)g_current_steps_x);
+    put_i32_le(out + 7, (int32_t)g_current_steps_y);
+    put_i32_le(out + 11, (int32_t)g_current_steps_z);
+    out[15] = op;
+    out[16] = (job.active && job.cell >= 0) ? (uint8_t)job.cell : 0xFF;
+    return STATE_BIN_LEN;
+}
+
+// Retorna o estado agregado da maquina (JSON compacto, ou binario com ?fmt=bin)
+static void route_state(struct http_state *hs, const struct http_request *req)
+{
+    const char *fmt = http_param(req, "fmt");
+    bool bin = fmt && strcmp(fmt, "bin") == 0;
+
+    // Toda mudanca de estado publica um evento; a fila e conferida a parte
+    bool hit;
+    HttpCacheEntry *e = http_cache_lookup(bin ? CACHE_STATE_BIN : CACHE_STATE_JSON,
+                                          g_event_seq, queue_depth(), &hit);
+    if (!hit && e)
+    {
+        e->len = bin ? state_binary((uint8_t *)e->data) : state_json(e->data, e->cap);
+        e->valid = true;
+    }
+    if (e)
+    {
+        http_cache_serve(hs, e);
+    }
+    else
+    {
+        // Entrada ainda em envio por outra conexao com a versao antiga
+        hs->body_len = bin ? state_binary((uint8_t *)hs->smallbuf) : state_json(hs->smallbuf, sizeof(hs->smallbuf));
+        hs->body_ptr = hs->smallbuf;
+    }
+    http_finish_response(hs, "200 OK", bin ? "application/octet-stream" : "application/json", NULL);
+}
+
+// Cache das respostas GET: uma entrada por rota/formato
+static char g_cache_history_buf[HTTP_CACHE_HISTORY_MAX];
+static char g_cache_state_buf[HTTP_CACHE_STATE_MAX];
+static char g_cache_state_bin_buf[STATE_BIN_LEN];
+static HttpCacheEntry g_http_cache[CACHE_COUNT] = {
+    [CACHE_HISTORY]    = { .data = g_cache_history_buf,   .cap = sizeof(g_cache_history_buf) },
+    [CACHE_STATE_JSON] = { .data = g_cache_state_buf,     .cap = sizeof(g_cache_state_buf) },
+    [CACHE_STATE_BIN]  = { .data = g_cache_state_bin_buf, .cap = sizeof(g_cache_state_bin_buf) },
+};
+
+// Procura a entrada de key na versao (version, aux). Em *hit = false, a entrada retornada
+// foi invalidada e deve ser preenchida pelo chamador; NULL se ela ainda esta em envio.
+static HttpCacheEntry *http_cache_lookup(int key, uint32_t version, uint32_t aux, bool *hit)
+{
+    HttpCacheEntry *e = &g_http_cache[key];
+    *hit = e->valid && e->version == version && e->aux == aux;
+    if (*hit)
+        return e;
+    if (e->refs > 0)
+        return NULL;
+    e->valid = false;
+    e->version = version;
+    e->aux = aux;
+    e->len = 0;
+    return e;
+}
+
+// Usa a entrada como corpo da resposta (copiado pelo lwIP no envio)
+static void http_cache_serve(struct http_state *hs, HttpCacheEntry *e)
+{
+    hs->body_ptr = e->data;
+    hs->body_len = e->len;
+    hs->cache_ref = e;
+    e->refs++;
+}
+
+// Libera a entrada do cache usada pela resposta anterior
+static void http_cache_release(struct http_state *hs)
+{
+    if (hs->cache_ref)
+    {
+        hs->cache_ref->refs--;
+        hs->cache_ref = NULL;
+    }
+}
+
+// Processar armazenamento de pallet
+static void route_store(struct http_state *hs, const struct http_request *req)
+{
+    char slot[10];
+    if (query_param(req, "slot", slot, sizeof(slot)))
+    {
+        PRINT_DEBUG(LOG_SUB_HTTP, "Armazenamento solicitado - Slot: %s\n", slot);
+        LOG_INFO(LOG_SUB_HTTP, "Web: Pedido de ARMAZENAR no slot %s", slot);
+
+        int cell_index = slot_para_indice(slot);
+        if (cell_index != -1) {
+            MovementCommand cmd = {0};
+            cmd.cell_index = cell_index;
+            cmd.is_store_operation = true; // true = guardar
+
+            // Envia o comando para a fila da task de motores (sem bloquear)
+            http_submit_job(hs, &cmd);
+            return;
+        } else {
+            LOG_ERROR(LOG_SUB_HTTP, "ERRO: Slot invalido '%s' recebido da web.", slot);
+            PRINT_ERROR(LOG_SUB_HTTP, "ERRO: Slot invalido '%s' da web.\n", slot);
+        }
+    }
+    http_finish_response(hs, "200 OK", NULL, NULL);
+}
+
+// Processar retirada de pallet
+static void route_retrieve(struct http_state *hs, const struct http_request *req)
+{
+    char slot[10];
+    if (query_param(req, "slot", slot, sizeof(slot)))
+    {
+        PRINT_DEBUG(LOG_SUB_HTTP, "Retirada solicitada - Slot: %s\n", slot);
+        LOG_INFO(LOG_SUB_HTTP, "Web: Pedido de RETIRAR do slot %s", slot);
+        
+        int cell_index = slot_para_indice(slot);
+        if (cell_index != -1) {
+            MovementCommand cmd = {0};
+            cmd.cell_index = cell_index;
+            cmd.is_store_operation = false; // false = retirar
+
+            // Envia o comando para a fila da task de motores (sem bloquear)
+            http_submit_job(hs, &cmd);
+            return;
+        } else {
+            LOG_ERROR(LOG_SUB_HTTP, "ERRO: Slot invalido '%s' recebido da web.", slot);
+            PRINT_ERROR(LOG_SUB_HTTP, "ERRO: Slot invalido '%s' da web.\n", slot);
+        }
+    }
+    http_finish_response(hs, "200 OK", NULL, NULL);
+}
+
+// Processar ativacao/desativacao do eletroima
+static void route_toggle_electromagnet(struct http_state *hs, const struct http_request *req)
+{
+    toggle_eletroima();
+    PRINT_DEBUG(LOG_SUB_MOTION, "Eletroima alternado - Status: %s\n", electromagnet_active ? "Ativado" : "Desativado");
+    LOG_DEBUG(LOG_SUB_MOTION, "Eletroima %s", electromagnet_active ? "ativado" : "desativado");
+    
+    http_finish_response(hs, "200 OK", NULL, NULL);
+}
+
+// Retorna o status atual do eletroima
+static void route_electromagnet_status(struct http_state *hs, const struct http_request *req)
+{
+    char etag[24];
+    http_make_etag(etag, sizeof(etag), 'm', g_state_version);
+    if (http_if_none_match(req, etag))
+    {
+        http_not_modified(hs, etag);
+        return;
+    }
+
+    hs->body_len = snprintf(hs->smallbuf, sizeof(hs->smallbuf), "{\"active\":%s}",
+                            electromagnet_active ? "true" : "false");
+    hs->body_ptr = hs->smallbuf;
+    http_finish_response(hs, "200 OK", "application/json", etag);
+}
+
+// Retorna os eixos ao ponto inicial (0,0,0)
+static void route_home(struct http_state *hs, const struct http_request *req)
+{
+    PRINT_DEBUG(LOG_SUB_HTTP, "Comando de retorno ao home recebido.\n");
+    LOG_INFO(LOG_SUB_HTTP, "Web: Solicitacao de retorno ao home (0,0,0)");
+    
+    // Cria um comando especial para retornar ao home
+    // Usamos um indice negativo para indicar que e um comando de home
+    MovementCommand home_cmd = {0};
+    home_cmd.cell_index = -1; // Codigo especial para home
+    home_cmd.is_store_operation = false;
+    
+    http_submit_job(hs, &home_cmd);
+}
+
+// Enfileira o comando sem bloquear: 200 com o id do job, ou 429 se a fila esta cheia
+static void http_submit_job(struct http_state *hs, MovementCommand *cmd)
+{
+    uint32_t job = job_submit(cmd);
+    if (!job)
+    {
+        PRINT_ERROR(LOG_SUB_HTTP, "ERRO: Fila de movimento cheia!\n");
+        hs->retry_after = QUEUE_FULL_RETRY_S;
+        http_finish_response(hs, "429 Too Many Requests", NULL, NULL);
+        return;
+    }
+    hs->body_len = snprintf(hs->smallbuf, sizeof(hs->smallbuf), "{\"job\":%lu}", (unsigned long)job);
+    hs->body_ptr = hs->smallbuf;
+    http_finish_response(hs, "200 OK", "application/json", NULL);
+}
+
+// Pagina principal
+static void route_page(struct http_state *hs, const struct http_request *req)
+{
+    // A pagina so muda com o firmware: o ETag e o hash gerado no boot
+    char etag[16];
+    snprintf(etag, sizeof(etag), "\"h%08lx\"", (unsigned long)g_html_etag);
+    if (http_if_none_match(req, etag))
+    {
+        http_not_modified(hs, etag);
+        return;
+    }
+
+    hs->body_ptr = html; // pagina constante em flash
+    hs->body_len = html_len;
+    hs->body_static = true;
+    http_finish_response(hs, "200 OK", "text/html", etag);
+}
+
+// Tabela de rotas com hash perfeito: cada rota fica no slot route_hash(metodo, caminho).
+// Slots e semente vem de lib/http_routes.h, gerado por lib/gen_routes.py (que procura uma
+// semente sem colisao); para adicionar uma rota, edite a lista no script e rode-o. O build
+// confere se o cabecalho esta em dia e http_router_check() para o boot se algo escapar.
+#define ROUTE_ENTRY(slot, method, path, handler, limited) [slot] = { method, path, handler, limited },
+static const http_route_t g_routes[ROUTE_TABLE_SIZE] = {
+    HTTP_ROUTES(ROUTE_ENTRY)
+};
+#undef ROUTE_ENTRY
+
+// Hash FNV-1a de "METODO caminho" reduzido ao tamanho da tabela
+static uint32_t route_hash(const char *method, const char *path)
+{
+    uint32_t h = ROUTE_HASH_SEED;
+    for (const char *c = method; *c; c++) {
+        h ^= (uint8_t)*c;
+        h *= 16777619u;
+    }
+    h ^= ' ';
+    h *= 16777619u;
+    for (const char *c = path; *c; c++) {
+        h ^= (uint8_t)*c;
+        h *= 16777619u;
+    }
+    return (h ^ (h >> 16)) & (ROUTE_TABLE_SIZE - 1);
+}
+
+// Confere se cada rota esta no slot do seu hash. Tabela desatualizada = rota inacessivel
+// (404 silencioso): para o firmware no boot em vez de seguir com ela.
+static void http_router_check(void)
+{
+    for (int i = 0; i < ROUTE_TABLE_SIZE; i++) {
+        if (g_routes[i].handler && route_hash(g_routes[i].method, g_routes[i].path) != (uint32_t)i) {
+            panic("rota %s %s fora do slot (%d, esperado %lu); rode lib/gen_routes.py", g_routes[i].method,
+                  g_routes[i].path, i, (unsigned long)route_hash(g_routes[i].method, g_routes[i].path));
+        }
+    }
+}
+
+// IPs recentes e suas fichas
+static RateBucket g_rate[RATE_MAX_CLIENTS];
+
+// Consome uma ficha do IP; sem fichas, informa em quantos segundos tentar de novo
+static bool rate_allow(uint32_t ip, uint8_t *retry_s)
+{
+    uint32_t now = to_ms_since_boot(get_absolute_time());
+    RateBucket *b = NULL;
+    RateBucket *oldest = &g_rate[0];
+    for (int i = 0; i < RATE_MAX_CLIENTS; i++) {
+        if (g_rate[i].used && g_rate[i].ip == ip) { b = &g_rate[i]; break; }
+        if (!g_rate[i].used || (oldest->used && now - g_rate[i].last_ms > now - oldest->last_ms))
+            oldest = &g_rate[i];
+    }
+    if (!b)
+    {
+        // IP novo: ocupa um slot livre ou o do IP menos recente, com a rajada cheia
+        b = oldest;
+        b->used = true;
+        b->ip = ip;
+        b->last_ms = now;
+        b->tokens_milli = RATE_BURST * 1000;
+    }
+
+    // Repoe RATE_PER_SEC fichas por segundo, ate RATE_BURST
+    uint32_t elapsed = now - b->last_ms;
+    if (elapsed > RATE_BURST * 1000 / RATE_PER_SEC)
+        elapsed = RATE_BURST * 1000 / RATE_PER_SEC;
+    b->tokens_milli += elapsed * RATE_PER_SEC;
+    if (b->tokens_milli > RATE_BURST * 1000)
+        b->tokens_milli = RATE_BURST * 1000;
+    b->last_ms = now;
+
+    if (b->tokens_milli >= 1000)
+    {
+        b->tokens_milli -= 1000;
+        return true;
+    }
+    uint32_t wait_ms = (1000 - b->tokens_milli + RATE_PER_SEC - 1) / RATE_PER_SEC;
+    *retry_s = (uint8_t)((wait_ms + 999) / 1000);
+    return false;
+}
+
+// Separa e decodifica os parametros da query string (in-place)
+static void http_parse_params(struct http_request *req)
+{
+    req->param_count = 0;
+    char *q = req->query;
+    while (*q && req->param_count < HTTP_MAX_PARAMS) {
+        char *amp = strchr(q, '&');
+        if (amp) *amp = '\0';
+        char *eq = strchr(q, '=');
+        if (eq) *eq = '\0';
+
+        url_decode_inplace(q);
+        req->params[req->param_count].key = q;
+        req->params[req->param_count].value = "";
+        if (eq) {
+            url_decode_inplace(eq + 1);
+            req->params[req->param_count].value = eq + 1;
+        }
+        req->param_count++;
+
+        if (!amp) break;
+        q = amp + 1;
+    }
+}
+
+// Monta a resposta de uma requisicao completa: uma consulta na tabela de rotas
+static void http_handle_request(struct http_state *hs, struct http_request *req)
+{
+    http_parse_params(req);
+
+    const http_route_t *route = &g_routes[route_hash(req->method, req->path)];
+    if (route->handler && strcmp(route->method, req->method) == 0 && strcmp(route->path, req->path) == 0)
+    {
+        // Rotas de comando: limite de requisicoes por IP de origem
+        uint8_t retry;
+        if (route->limited && !rate_allow(ip4_addr_get_u32(ip_2_ip4(&hs->pcb->remote_ip)), &retry))
+        {
+            PRINT_WARN(LOG_SUB_HTTP, "HTTP: limite de requisicoes excedido (%s %s)\n", req->method, req->path);
+            hs->retry_after = retry;
+            http_finish_response(hs, "429 Too Many Requests", NULL, NULL);
+            return;
+        }
+        route->handler(hs, req);
+    }
+    else if (strcmp(req->method, "GET") == 0)
+    {
+        // Rota padrao: qualquer outro GET recebe a pagina principal
+        route_page(hs, req);
+    }
+    else
+    {
+        http_finish_response(hs, "404 Not Found", NULL, NULL);
+    }
+}
+
+// Funcao de callback para aceitar novas conexoes TCP
+static err_t connection_callback(void *arg, struct tcp_pcb *newpcb, err_t err)
+{
+    if (err != ERR_OK || !newpcb)
+        return ERR_VAL;
+
+    // O estado vive enquanto a conexao estiver aberta (keep-alive)
+    struct http_state *hs = calloc(1, sizeof(struct http_state));
+    if (!hs || !http_conn_register(hs))
+    {
+        free(hs);
+        g_http_stats.rejected++;
+        tcp_abort(newpcb);
+        return ERR_ABRT;
+    }
+    http_parser_reset(&hs->req);
+    hs->pcb = newpcb;
+    g_http_stats.accepted++;
+
+    // Keepalive TCP: clientes que sumiram sem FIN/RST geram tcp_err
+    ip_set_option(newpcb, SOF_KEEPALIVE);
+    newpcb->keep_idle = HTTP_TCP_KEEPALIVE_MS;
+    newpcb->keep_intvl = HTTP_TCP_KEEPALIVE_MS / 6;
+    newpcb->keep_cnt = 3;
+
+    tcp_arg(newpcb, hs);
+    tcp_recv(newpcb, http_recv);
+    tcp_sent(newpcb, http_sent);
+    tcp_poll(newpcb, http_poll, HTTP_POLL_INTERVAL);
+    tcp_err(newpcb, http_err);
+    return ERR_OK;
+}
+
+// Coloca a conexao na lista de conexoes vivas. Com a lista cheia, fecha a conexao
+// keep-alive ociosa ha mais tempo; sem nenhuma ociosa, a nova conexao e recusada.
+static bool http_conn_register(struct http_state *hs)
+{
+    int slot = -1;
+    struct http_state *victim = NULL;
+    for (int i = 0; i < HTTP_MAX_CONNS; i++) {
+        struct http_state *c = g_http_conns[i];
+        if (!c) { slot = i; break; }
+        if (!c->busy && !c->rx_pbuf && (!victim || c->idle_ticks > victim->idle_ticks))
+            victim = c;
+    }
+    if (slot < 0)
+    {
+        if (!victim)
+            return false;
+        PRINT_WARN(LOG_SUB_HTTP, "HTTP: limite de conexoes, fechando conexao ociosa\n");
+        g_http_stats.evicted++;
+        http_close(victim->pcb, victim);
+        for (int i = 0; i < HTTP_MAX_CONNS; i++) {
+            if (!g_http_conns[i]) { slot = i; break; }
+        }
+    }
+    g_http_conns[slot] = hs;
+    return true;
+}
+
+// Retorna as contagens de conexoes vivas e os contadores do gerenciador
+static void route_connections(struct http_state *hs, const struct http_request *req)
+{
+    int http = 0, sse = 0, ws = 0;
+    for (int i = 0; i < HTTP_MAX_CONNS; i++) {
+        if (!g_http_conns[i]) continue;
+        http++;
+        if (g_http_conns[i]->sse) sse++;
+        if (g_http_conns[i]->ws) ws++;
+    }
+    struct mallinfo mi = mallinfo();
+    hs->body_len = snprintf(hs->smallbuf, sizeof(hs->smallbuf),
+                            "{\"http\":%d,\"sse\":%d,\"ws\":%d,\"wms\":%d,\"max\":%d,"
+                            "\"accepted\":%lu,\"rejected\":%lu,\"evicted\":%lu,\"errors\":%lu,\"heap_used\":%u}",
+                            http, sse, ws, m2m_client_count(), HTTP_MAX_CONNS,
+                            (unsigned long)g_http_stats.accepted, (unsigned long)g_http_stats.rejected,
+                            (unsigned long)g_http_stats.evicted, (unsigned long)g_http_stats.errors,
+                            (unsigned)mi.uordblks);
+    hs->body_ptr = hs->smallbuf;
+    http_finish_response(hs, "200 OK", "application/json", NULL);
+}
+
+// Funcao para iniciar o servidor HTTP
+static void start_http_server(void)
+{
+    struct tcp_pcb *pcb = tcp_new();
+    if (!pcb)
+    {
+        PRINT_ERROR(LOG_SUB_HTTP, "Erro ao criar PCB TCP\n");
+        return;
+    }
+    if (tcp_bind(pcb, IP_ADDR_ANY, 80) != ERR_OK)
+    {
+        PRINT_ERROR(LOG_SUB_HTTP, "Erro ao ligar o servidor na porta 80\n");
+        return;
+    }
+    pcb = tcp_listen_with_backlog(pcb, HTTP_ACCEPT_BACKLOG);
+    tcp_accept(pcb, connection_callback);
+    PRINT_INFO(LOG_SUB_HTTP, "Servidor HTTP rodando na porta 80...\n");
+}
+
+// -------------------- Protocolo binario (WMS) --------------------
+
+// Conexao do protocolo binario
+struct m2m_state
+{
+    struct tcp_pcb *pcb;
+    struct pbuf *rx_pbuf;           // bytes recebidos ainda nao consumidos
+    uint8_t out[M2M_OUT_MAX];       // frames aguardando espaco no buffer de envio
+    uint16_t out_len;
+    bool subscribed;                // recebe os eventos de estado (M2M_SUBSCRIBE)
+    uint32_t event_seq;             // proximo evento a enviar
+};
+
+static struct m2m_state *g_m2m_clients[M2M_MAX_CLIENTS];
+
+// Acrescenta um frame [tamanho][tipo][seq][payload] ao buffer de saida
+static void m2m_frame(struct m2m_state *ms, uint8_t type, uint8_t seq, const uint8_t *payload, size_t len)
+{
+    size_t flen = 2 + len;
+    if (ms->out_len + 2 + flen > M2M_OUT_MAX)
+        return;
+    uint8_t *o = ms->out + ms->out_len;
+    o[0] = (uint8_t)(flen & 0xFF);
+    o[1] = (uint8_t)(flen >> 8);
+    o[2] = type;
+    o[3] = seq;
+    if (len)
+        memcpy(o + 4, payload, len);
+    ms->out_len += 2 + flen;
+}
+
+// Envia o que couber do buffer de saida
+static void m2m_flush(struct m2m_state *ms)
+{
+    size_t n = tcp_sndbuf(ms->pcb);
+    if (n > ms->out_len)
+        n = ms->out_len;
+    if (n == 0)
+        return;
+    if (tcp_write(ms->pcb, ms->out, (u16_t)n, TCP_WRITE_FLAG_COPY) != ERR_OK)
+        return; // retoma no m2m_sent/m2m_poll
+    memmove(ms->out, ms->out + n, ms->out_len - n);
+    ms->out_len -= n;
+    tcp_output(ms->pcb);
+}
+
+// Converte a UID em texto ("12 34 56 78") para bytes
+static size_t uid_to_bytes(const char *txt, uint8_t *out, size_t cap)
+{
+    size_t n = 0;
+    while (*txt && n < cap) {
+        char *end;
+        unsigned long v = strtoul(txt, &end, 16);
+        if (end == txt) break;
+        out[n++] = (uint8_t)v;
+        txt = end;
+    }
+    return n;
+}
+
+// Submete um job: [op, celula, eixo, passos int32] -> [resultado, job u32]
+static void m2m_submit_job(struct m2m_state *ms, uint8_t seq, const uint8_t *p, size_t n)
+{
+    MovementCommand cmd = {0};
+    uint8_t reply[5] = { CMD_ERR_INVALID };
+    bool valid = false;
+
+    switch (p[0])
+    {
+    case JOB_OP_STORE:
+    case JOB_OP_RETRIEVE:
+        if (p[1] >= 6) break;
+        cmd.cell_index = p[1];
+        cmd.is_store_operation = p[0] == JOB_OP_STORE;
+        LOG_INFO(LOG_SUB_HTTP, "WMS: Pedido de %s no slot %s", cmd.is_store_operation ? "ARMAZENAR" : "RETIRAR",
+                 indice_para_slot(p[1]));
+        valid = true;
+        break;
+    case JOB_OP_HOME:
+        cmd.cell_index = -1;
+        LOG_INFO(LOG_SUB_HTTP, "WMS: Solicitacao de retorno ao home (0,0,0)");
+        valid = true;
+        break;
+    case JOB_OP_JOG:
+        if (p[2] > 2) break;
+        cmd.cell_index = -2;
+        cmd.jog_axis = p[2];
+        cmd.jog_steps = (int32_t)((uint32_t)p[3] | (uint32_t)p[4] << 8 | (uint32_t)p[5] << 16 | (uint32_t)p[6] << 24);
+        valid = true;
+        break;
+    default:
+        break;
+    }
+
+    if (valid)
+    {
+        uint32_t job = job_submit(&cmd);
+        reply[0] = job ? CMD_OK : CMD_ERR_BUSY;
+        put_i32_le(reply + 1, (int32_t)job);
+    }
+    m2m_frame(ms, M2M_SUBMIT_JOB | 0x80, seq, reply, sizeof(reply));
+}
+
+// Trata um frame completo do cliente
+static void m2m_handle(struct m2m_state *ms, uint8_t type, uint8_t seq, const uint8_t *p, size_t n)
+{
+    // Tamanho minimo do payload de cada tipo
+    static const uint8_t min_len[] = { 0, 7, 4, 0, 1 };
+    if (type >= sizeof(min_len))
+    {
+        uint8_t code = M2M_ERR_TYPE;
+        m2m_frame(ms, M2M_ERROR, seq, &code, 1);
+        return;
+    }
+    if (n < min_len[type])
+    {
+        uint8_t code = M2M_ERR_LENGTH;
+        m2m_frame(ms, M2M_ERROR, seq, &code, 1);
+        return;
+    }
+
+    switch (type)
+    {
+    case M2M_PING:
+        m2m_frame(ms, M2M_PING | 0x80, seq, NULL, 0);
+        break;
+
+    case M2M_SUBMIT_JOB:
+        m2m_submit_job(ms, seq, p, n);
+        break;
+
+    case M2M_QUERY_JOB:
+    {
+        uint32_t id = (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+        uint8_t reply[7];
+        JobRecord rec = { .id = id, .state = JOB_UNKNOWN, .op = 0, .cell = -1 };
+        job_lookup(id, &rec);
+        put_i32_le(reply, (int32_t)id);
+        reply[4] = rec.state;
+        reply[5] = rec.op;
+        reply[6] = (uint8_t)rec.cell;
+        m2m_frame(ms, M2M_QUERY_JOB | 0x80, seq, reply, sizeof(reply));
+        break;
+    }
+
+    case M2M_INVENTORY:
+    {
+        uint8_t reply[1 + 6 * (2 + UID_STRLEN / 3)];
+        size_t off = 1;
+        reply[0] = 6;
+        char uids[6][UID_STRLEN];
+        inventory_snapshot(uids);
+        for (int i = 0; i < 6; i++) {
+            reply[off] = (uint8_t)i;
+            reply[off + 1] = (uint8_t)uid_to_bytes(uids[i], reply + off + 2, UID_STRLEN / 3);
+            off += 2 + reply[off + 1];
+        }
+        m2m_frame(ms, M2M_INVENTORY | 0x80, seq, reply, off);
+        break;
+    }
+
+    case M2M_SUBSCRIBE:
+    {
+        ms->subscribed = p[0] != 0;
+        ms->event_seq = g_event_seq;
+        uint8_t reply[STATE_BIN_LEN];
+        m2m_frame(ms, M2M_SUBSCRIBE | 0x80, seq, reply, state_binary(reply));
+        break;
+    }
+    }
+}
+
+// Acrescenta os eventos novos para um cliente inscrito
+static void m2m_push_events(struct m2m_state *ms)
+{
+    DeviceEvent ev;
+    while (ms->subscribed && ms->out_len + M2M_REPLY_MAX <= M2M_OUT_MAX && event_get(&ms->event_seq, &ev))
+    {
+        uint8_t payload[4 + 1 + 16 + EVENT_DATA_MAX];
+        size_t tlen = strlen(ev.type);
+        size_t dlen = strnlen(ev.data, EVENT_DATA_MAX);
+        if (tlen > 16) tlen = 16;
+        put_i32_le(payload, (int32_t)ms->event_seq);
+        payload[4] = (uint8_t)tlen;
+        memcpy(payload + 5, ev.type, tlen);
+        memcpy(payload + 5 + tlen, ev.data, dlen);
+        m2m_frame(ms, M2M_EVENT, 0, payload, 5 + tlen + dlen);
+        ms->event_seq++;
+    }
+}
+
+// Consome os frames completos; para quando o buffer de saida nao comporta mais respostas.
+// Retorna false em erro de protocolo (frame grande demais): a conexao deve ser fechada.
+static bool m2m_process(struct m2m_state *ms)
+{
+    while (ms->rx_pbuf && ms->out_len + M2M_REPLY_MAX <= M2M_OUT_MAX)
+    {
+        u16_t avail = ms->rx_pbuf->tot_len;
+        uint8_t frame[2 + M2M_FRAME_MAX];
+        if (avail < 2)
+            break;
+        pbuf_copy_partial(ms->rx_pbuf, frame, 2, 0);
+        u16_t len = (u16_t)(frame[0] | frame[1] << 8);
+        if (len < 2 || len > M2M_FRAME_MAX)
+            return false;
+        if (avail < 2 + len)
+            break; // aguarda o resto do frame
+
+        pbuf_copy_partial(ms->rx_pbuf, frame, 2 + len, 0);
+        tcp_recved(ms->pcb, 2 + len);
+        ms->rx_pbuf = pbuf_free_header(ms->rx_pbuf, 2 + len);
+        m2m_handle(ms, frame[2], frame[3], frame + 4, len - 2);
+    }
+    m2m_push_events(ms);
+    m2m_flush(ms);
+    return true;
+}
+
+// Libera o estado da conexao (o pcb ja foi fechado ou liberado pelo lwIP)
+static void m2m_free(struct m2m_state *ms)
+{
+    for (int i = 0; i < M2M_MAX_CLIENTS; i++) {
+        if (g_m2m_clients[i] == ms) g_m2m_clients[i] = NULL;
+    }
+    if (ms->rx_pbuf)
+        pbuf_free(ms->rx_pbuf);
+    free(ms);
+}
+
+// Fecha a conexao e libera o estado (retorna ERR_ABRT se precisou abortar)
+static err_t m2m_close(struct tcp_pcb *tpcb, struct m2m_state *ms)
+{
+    tcp_arg(tpcb, NULL);
+    tcp_recv(tpcb, NULL);
+    tcp_sent(tpcb, NULL);
+    tcp_poll(tpcb, NULL, 0);
+    tcp_err(tpcb, NULL);
+    if (ms)
+        m2m_free(ms);
+    if (tcp_close(tpcb) != ERR_OK)
+    {
+        tcp_abort(tpcb);
+        return ERR_ABRT;
+    }
+    return ERR_OK;
+}
+
+// Erro de protocolo (frame grande demais): derruba a conexao
+static err_t m2m_abort(struct tcp_pcb *tpcb, struct m2m_state *ms)
+{
+    PRINT_WARN(LOG_SUB_HTTP, "WMS: frame invalido, fechando conexao\n");
+    tcp_arg(tpcb, NULL);
+    tcp_err(tpcb, NULL);
+    m2m_free(ms);
+    tcp_abort(tpcb);
+    return ERR_ABRT;
+}
+
+// Funcao de callback para receber frames do protocolo binario
+static err_t m2m_recv(void *arg, struct tcp_pcb *tpcb, struct pbuf *p, err_t err)
+{
+    struct m2m_state *ms = (struct m2m_state *)arg;
+    if (!p)
+        return m2m_close(tpcb, ms);
+    if (!ms)
+    {
+        tcp_recved(tpcb, p->tot_len);
+        pbuf_free(p);
+        return ERR_OK;
+    }
+
+    if (ms->rx_pbuf)
+        pbuf_cat(ms->rx_pbuf, p);
+    else
+        ms->rx_pbuf = p;
+
+    if (!m2m_process(ms))
+        return m2m_abort(tpcb, ms);
+    return ERR_OK;
+}
+
+// Janela liberada: envia o restante e retoma frames que aguardavam espaco
+static err_t m2m_sent(void *arg, struct tcp_pcb *tpcb, u16_t len)
+{
+    struct m2m_state *ms = (struct m2m_state *)arg;
+    if (ms && !m2m_process(ms))
+        return m2m_abort(tpcb, ms);
+    return ERR_OK;
+}
+
+// Retoma envios que pararam por falta de memoria no lwIP
+static err_t m2m_poll(void *arg, struct tcp_pcb *tpcb)
+{
+    struct m2m_state *ms = (struct m2m_state *)arg;
+    if (ms)
+        m2m_flush(ms);
+    return ERR_OK;
+}
+
+// Conexao perdida (RST, timeout): o pcb ja foi liberado pelo lwIP
+static void m2m_err(void *arg, err_t err)
+{
+    struct m2m_state *ms = (struct m2m_state *)arg;
+    if (ms)
+        m2m_free(ms);
+}
+
+// Funcao de callback para aceitar conexoes do protocolo binario
+static err_t m2m_accept(void *arg, struct tcp_pcb *newpcb, err_t err)
+{
+    if (err != ERR_OK || !newpcb)
+        return ERR_VAL;
+
+    int slot = -1;
+    for (int i = 0; i < M2M_MAX_CLIENTS; i++) {
+        if (!g_m2m_clients[i]) { slot = i; break; }
+    }
+    struct m2m_state *ms = slot >= 0 ? calloc(1, sizeof(struct m2m_state)) : NULL;
+    if (!ms)
+    {
+        tcp_abort(newpcb);
+        return ERR_ABRT;
+    }
+    ms->pcb = newpcb;
+    g_m2m_clients[slot] = ms;
+
+    tcp_nagle_disable(newpcb); // respostas pequenas saem na hora
+    tcp_arg(newpcb, ms);
+    tcp_recv(newpcb, m2m_recv);
+    tcp_sent(newpcb, m2m_sent);
+    tcp_poll(newpcb, m2m_poll, HTTP_POLL_INTERVAL);
+    tcp_err(newpcb, m2m_err);
+    return ERR_OK;
+}
+
+// Funcao para iniciar o servidor do protocolo binario
+static void start_m2m_server(void)
+{
+    struct tcp_pcb *pcb = tcp_new();
+    if (!pcb)
+    {
+        PRINT_ERROR(LOG_SUB_HTTP, "Erro ao criar PCB TCP (WMS)\n");
+        return;
+    }
+    if (tcp_bind(pcb, IP_ADDR_ANY, M2M_PORT) != ERR_OK)
+    {
+        PRINT_ERROR(LOG_SUB_HTTP, "Erro ao ligar o protocolo binario na porta %d\n", M2M_PORT);
+        return;
+    }
+    pcb = tcp_listen(pcb);
+    tcp_accept(pcb, m2m_accept);
+    PRINT_INFO(LOG_SUB_HTTP, "Protocolo binario (WMS) rodando na porta %d...\n", M2M_PORT);
+}
+
+// Conexoes do protocolo binario abertas
+static int m2m_client_count(void)
+{
+    int n = 0;
+    for (int i = 0; i < M2M_MAX_CLIENTS; i++) {
+        if (g_m2m_clients[i]) n++;
+    }
+    return n;
+}
+
+// Chamado pelo stream_pump (com o lwIP travado): envia eventos novos aos clientes inscritos
+static void m2m_pump(void)
+{
+    for (int i = 0; i < M2M_MAX_CLIENTS; i++) {
+        struct m2m_state *ms = g_m2m_clients[i];
+        if (ms && ms->subscribed && ms->event_seq != g_event_seq)
+        {
+            m2m_push_events(ms);
+            m2m_flush(ms);
+        }
+    }
+}
+
+// Calcula o hash da pagina HTML usado como ETag
+static void http_assets_init(void)
+{
+    g_html_etag = fnv1a32(html, html_len);
+    g_boot_id = get_rand_32();
+    http_router_check();
+}
+
+// Hash FNV-1a de 32 bits
+static uint32_t fnv1a32(const void *data, size_t len)
+{
+    const uint8_t *p = (const uint8_t *)data;
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// Verifica se o If-None-Match da requisicao contem o ETag (ou "*")
+static bool http_if_none_match(const struct http_request *req, const char *etag)
+{
+    const char *v = req->if_none_match;
+    if (v[0] == '\0') return false;
+    if (strcmp(v, "*") == 0) return true;
+    return strstr(v, etag) != NULL;
+}
+
+// Monta um ETag forte a partir de um contador de versao (ex: "l1a2b3c4d-00000012")
+static void http_make_etag(char *out, size_t outsz, char tag, uint32_t version)
+{
+    snprintf(out, outsz, "\"%c%08lx-%08lx\"", tag, (unsigned long)g_boot_id, (unsigned long)version);
+}
+
+// Preenche a resposta 304 Not Modified (sem corpo)
+static void http_not_modified(struct http_state *hs, const char *etag)
+{
+    hs->body_ptr = NULL;
+    hs->body_len = 0;
+    http_finish_response(hs, "304 Not Modified", NULL, etag);
+}
+
+// Escapa uma string para dentro de aspas JSON; retorna o tamanho escrito
+static size_t json_escape(char *out, size_t outsz, const char *in)
+{
+    size_t j = 0;
+    for (size_t k = 0; in[k] && j + 2 < outsz; k++)
+    {
+        if (in[k] == '"' || in[k] == '\\')
+        {
+            out[j++] = '\\';
+            out[j++] = in[k];
+        }
+        else if ((unsigned char)in[k] < 0x20)
+        {
+            out[j++] = ' ';
+        }
+        else
+        {
+            out[j++] = in[k];
+        }
+    }
+    out[j] = '\0';
+    return j;
+}
+
+// Simples utilitarios para parsing de URL/query
+static int url_hex(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return -1;
+}
+
+// Decodifica URL inplace (modifica a string original)
+static void url_decode_inplace(char *s) {
+    char *w = s;
+    while (*s) {
+        if (*s == '+') { *w++ = ' '; s++; }
+        else if (*s == '%' && isxdigit((unsigned char)s[1]) && isxdigit((unsigned char)s[2])) {
+            int hi = url_hex(s[1]);
+            int lo = url_hex(s[2]);
+            if (hi >= 0 && lo >= 0) {
                 *w++ = (char)((hi << 4) | lo);
                 s += 3;
             } else {
@@ -733,29 +3308,20 @@ static void url_decode_inplace(char *s) {
     *w = '\0';
 }
 
-// Procura key na query string da primeira linha (apos '?') e copia o valor decodificado
-static bool query_param(const char *req, const char *key, char *out, size_t outsz) {
-    const char *q = strchr(req, '?');
-    if (!q) return false;
-    q++; // after ?
-    size_t klen = strlen(key);
-    while (*q && *q != '\r' && *q != '\n' && *q != ' ') {
-        if (strncmp(q, key, klen) == 0 && q[klen] == '=') {
-            const char *v = q + klen + 1;
-            size_t i = 0;
-            while (*v && *v != '&' && *v != ' ' && *v != '\r' && *v != '\n') {
-                if (i + 1 < outsz) out[i++] = *v;
-                v++;
-            }
-            out[i] = '\0';
-            url_decode_inplace(out);
-            return true;
-        }
-        // skip to next param
-        while (*q && *q != '&' && *q != ' ' && *q != '\r' && *q != '\n') q++;
-        if (*q == '&') q++;
+// Retorna o valor (ja decodificado) do parametro key, ou NULL
+static const char *http_param(const struct http_request *req, const char *key) {
+    for (int i = 0; i < req->param_count; i++) {
+        if (strcmp(req->params[i].key, key) == 0) return req->params[i].value;
     }
-    return false;
+    return NULL;
+}
+
+// Copia o valor do parametro key (truncado em outsz)
+static bool query_param(const struct http_request *req, const char *key, char *out, size_t outsz) {
+    const char *v = http_param(req, key);
+    if (!v) return false;
+    snprintf(out, outsz, "%s", v);
+    return true;
 }
 
 // Função para validar token
@@ -853,7 +3419,7 @@ static void init_cnc_pins(void) {
     gpio_set_dir(ENDSTOP_PIN_Z, GPIO_IN);
     gpio_pull_up(ENDSTOP_PIN_Z);
     
-    printf("Pinos da CNC inicializados.\n");
+    PRINT_INFO(LOG_SUB_MOTION, "Pinos da CNC inicializados.\n");
 }
 
 // Gera um unico pulso de passo
@@ -870,7 +3436,7 @@ static void step_motor(uint step_pin, uint dir_pin, bool direction, uint delay_u
 static void home_all_axes(void) {
     // Condicao de seguranca: executar apenas com Z no topo (0)
     if (g_current_steps_z != 0) {
-        log_push("Home XY abortado: Z != 0 (Z=%ld)", g_current_steps_z);
+        LOG_WARN(LOG_SUB_MOTION, "Home XY abortado: Z != 0 (Z=%ld)", g_current_steps_z);
         lcd_update_line(1, "Home XY: Z!=0");
         return;
     }
@@ -885,11 +3451,41 @@ static void home_all_axes(void) {
     // Mantem Z em 0 e retorna X/Y para 0
     move_axes_to_steps(0, 0, g_current_steps_z);
 
-    log_push("Home XY software: (%ld,%ld)->(0,0)", start_x, start_y);
-    printf("Home XY (software) concluido.\n");
+    LOG_INFO(LOG_SUB_MOTION, "Home XY software: (%ld,%ld)->(0,0)", start_x, start_y);
+    PRINT_INFO(LOG_SUB_MOTION, "Home XY (software) concluido.\n");
     lcd_update_line(1, "Home XY OK");
 }
 
+// Move um unico eixo de forma relativa (jog), sem passar do home nem do curso de cada eixo
+static void jog_axis(uint8_t axis, long steps) {
+    if (axis > 2) return;
+    long x_max = (long)(X_TRAVEL_MAX_MM * STEPS_PER_MM_X);
+    long y_max = (long)(Y_TRAVEL_MAX_MM * STEPS_PER_MM_Y);
+    long z_max = (long)(Z_TRAVEL_MAX_MM * STEPS_PER_MM_Z);
+
+    // Limita o deslocamento ao curso antes de somar (um frame com int32 extremo estouraria)
+    long max = axis == 0 ? x_max : axis == 1 ? y_max : z_max;
+    if (steps > max) steps = max;
+    if (steps < -max) steps = -max;
+
+    long x = g_current_steps_x;
+    long y = g_current_steps_y;
+    long z = g_current_steps_z;
+    if (axis == 0) x += steps;
+    else if (axis == 1) y += steps;
+    else z += steps;
+
+    if (x < 0) x = 0;
+    if (y < 0) y = 0;
+    if (z < 0) z = 0;
+    if (x > x_max) x = x_max;
+    if (y > y_max) y = y_max;
+    if (z > z_max) z = z_max;
+
+    LOG_INFO(LOG_SUB_MOTION, "CNC: Jog %c %ld passos", "XYZ"[axis], steps);
+    move_axes_to_steps(x, y, z);
+}
+
 // Move os eixos para uma coordenada ABSOLUTA em PASSOS
 static void move_axes_to_steps(long target_x_steps, long target_y_steps, long target_z_steps) {
     
@@ -916,6 +3512,8 @@ static void move_axes_to_steps(long target_x_steps, long target_y_steps, long ta
          max_steps = steps_z;
     }
 
+    motion_progress_begin(target_x_steps, target_y_steps, target_z_steps, max_steps);
+
     // --- Loop de movimento intercalado ---
     for (long i = 0; i < max_steps; i++) {
         if (i < steps_x) {
@@ -931,8 +3529,12 @@ static void move_axes_to_steps(long target_x_steps, long target_y_steps, long ta
             step_motor(STEP_PIN_Z, DIR_PIN_Z, dir_z, STEP_DELAY_Z_US);
         }
         
-        if(i % 20 == 0) cyw43_arch_poll(); // Mantem o WiFi vivo
+        if(i % 20 == 0) {
+            cyw43_arch_poll(); // Mantem o WiFi vivo
+            motion_progress_step(i);
+        }
     }
+    motion_progress_end();
     
     // --- Atualiza as posicoes globais de TODOS os eixos ---
     g_current_steps_x = target_x_steps;
@@ -942,210 +3544,1119 @@ static void move_axes_to_steps(long target_x_steps, long target_y_steps, long ta
     // Atualiza os ultimos alvos de X/Y 
     g_last_target_steps_x = target_x_steps;
     g_last_target_steps_y = target_y_steps;
+
+    event_publish("position", "{\"x\":%.2f,\"y\":%.2f,\"z\":%.2f}",
+                  target_x_steps / STEPS_PER_MM_X, target_y_steps / STEPS_PER_MM_Y, target_z_steps / STEPS_PER_MM_Z);
+}
+
+// Inicio de um movimento: guarda origem e deslocamento para a barra de progresso do LCD
+static void motion_progress_begin(long tx, long ty, long tz, long total) {
+    g_motion_progress.active = false;
+    g_motion_progress.gen++;
+    g_motion_progress.done = 0;
+    g_motion_progress.total = (uint32_t)total;
+    g_motion_progress.start_ms = to_ms_since_boot(get_absolute_time());
+    g_motion_progress.from_x = g_current_steps_x;
+    g_motion_progress.from_y = g_current_steps_y;
+    g_motion_progress.from_z = g_current_steps_z;
+    g_motion_progress.dx = tx - g_current_steps_x;
+    g_motion_progress.dy = ty - g_current_steps_y;
+    g_motion_progress.dz = tz - g_current_steps_z;
+    g_motion_progress.active = total > 0;
+}
+
+// Chamado a cada 20 iteracoes do laco de passos: so um store, nada de LCD aqui
+static inline void motion_progress_step(long done) {
+    g_motion_progress.done = (uint32_t)done;
+}
+
+static void motion_progress_end(void) {
+    g_motion_progress.active = false;
 }
 
-// Executa a sequencia completa para pegar ou soltar um pallet
-static void execute_cell_operation(int cell_index, bool is_pickup_operation) {
+// Executa a sequencia completa para pegar ou soltar um pallet (false = abortada)
+static bool execute_cell_operation(int cell_index, bool is_pickup_operation) {
     if (cell_index < 0 || cell_index >= 6) {
-        printf("Erro: indice de celula invalido %d\n", cell_index);
-        log_push("CNC: Erro, celula %d invalida", cell_index);
+        PRINT_ERROR(LOG_SUB_MOTION, "Erro: indice de celula invalido %d\n", cell_index);
+        LOG_ERROR(LOG_SUB_MOTION, "CNC: Erro, celula %d invalida", cell_index);
         lcd_update_line(0, "ERRO: Cel Inval"); // <- FEEDBACK LCD
+        return false;
+    }
+
+    // 1. Busca as coordenadas em MM da celula alvo
+    CellPosition target_mm = g_cell_map[cell_index];
+    const char* slot_name = indice_para_slot(cell_index); // "A1", "B2", etc.
+    
+    // 2. CONVERTE as coordenadas de MM para PASSOS
+    long target_x_steps = (long)(target_mm.x_mm * STEPS_PER_MM_X);
+    long target_y_steps = (long)(target_mm.y_mm * STEPS_PER_MM_Y);
+    long z_safe_steps   = (long)(Z_SAFE_MM * STEPS_PER_MM_Z);
+    long z_pickup_steps = (long)(Z_PICKUP_MM * STEPS_PER_MM_Z);
+
+    // A sua solicitacao pede para "retornar a posicao 0".
+    long z_return_steps = 0; // Z em 0 (topo)
+
+    char op_str[16];
+    snprintf(op_str, 16, "%s %s", is_pickup_operation ? "Pegando" : "Guardando", slot_name);
+    LOG_INFO(LOG_SUB_MOTION, "CNC: %s (X:%.1f, Y:%.1f)", op_str, target_mm.x_mm, target_mm.y_mm);
+    const char *op_id = is_pickup_operation ? "retrieve" : "store";
+    job_phase(cell_index, op_id, "z_seguro");
+    lcd_update_line(0, op_str);      // <- FEEDBACK LCD
+    lcd_update_line(1, "Movendo Z-Safe"); // <- FEEDBACK LCD
+
+    // 3. --- INiCIO DA SEQUeNCIA DE MOVIMENTO ---
+    
+    // 3.1. Sobe o Z para a altura de seguranca (SEMPRE)
+    // (Usamos g_current_steps_x e _y para mover apenas Z)
+    move_axes_to_steps(g_current_steps_x, g_current_steps_y, z_safe_steps);
+
+    // 3.2. Move X e Y para a posicao (X, Y) da celula
+    job_phase(cell_index, op_id, "movendo_xy");
+    lcd_update_line(1, "Movendo X/Y..."); // <- FEEDBACK LCD
+    move_axes_to_steps(target_x_steps, target_y_steps, z_safe_steps);
+
+    // 3.3. Desce o Z para a altura de pickup/dropoff
+    job_phase(cell_index, op_id, "descendo_z");
+    lcd_update_line(1, "Descendo Z..."); // <- FEEDBACK LCD
+    move_axes_to_steps(target_x_steps, target_y_steps, z_pickup_steps);
+
+    vTaskDelay(pdMS_TO_TICKS(250)); // Pausa para estabilizar
+    job_phase(cell_index, op_id, "lendo_rfid");
+    lcd_update_line(1, "Lendo RFID..."); // <- FEEDBACK LCD
+
+    // 3.4. --- LoGICA RFID ---
+    char scanned_uid[UID_STRLEN];
+    bool pallet_present = scan_for_uid(scanned_uid, UID_STRLEN);
+    
+    bool operation_aborted = false;
+
+    if (is_pickup_operation) {
+
+        // RFID ainda nao foi implementado, codigo inutilizado
+
+        // --- LoGICA DE RETIRADA (REGRA 2) ---
+        /*if (!pallet_present) {
+            // ERRO: Tentou pegar, mas o slot esta vazio
+            LOG_ERROR(LOG_SUB_RFID, "ERRO: Slot %s esta VAZIO. Operacao de retirada abortada.", slot_name);
+            lcd_update_line(1, "ERRO: Slot Vazio!");
+            operation_aborted = true; // Marca para abortar
+        } else {*/
+            // Sucesso: Pallet esta la.
+            LOG_INFO(LOG_SUB_RFID, "Pallet [..%s] detectado em %s. Retirando.", 
+                   (strlen(scanned_uid) > 9 ? scanned_uid + strlen(scanned_uid) - 9 : scanned_uid), slot_name);
+            lcd_update_line(1, "Pallet OK. Ligando");
+            
+            // ATIVA O ELETROIMA (para pegar)
+            ativar_eletroima();
+            vTaskDelay(pdMS_TO_TICKS(500)); // Espera 500ms
+
+            // Atualiza o inventario (critical section: o nucleo 1 tambem le)
+            critical_section_enter_blocking(&g_inventory_cs);
+            g_cell_uids[cell_index][0] = '\0'; // Slot agora esta vazio
+            g_state_version++;
+            critical_section_exit(&g_inventory_cs);
+            event_publish("inventory", "{\"slot\":\"%s\",\"uid\":\"\"}", slot_name);
+            // O ELETROIMA CONTINUA ATIVO (conforme Regra 2)
+        //}
+
+    } else {
+        // --- LoGICA DE ARMAZENAMENTO (REGRA 1) ---
+        if (pallet_present) {
+            // ERRO: Tentou guardar, mas o slot esta ocupado
+            LOG_ERROR(LOG_SUB_RFID, "ERRO: Slot %s esta OCUPADO (UID: %s). Operacao de guarda abortada.", slot_name, scanned_uid);
+            lcd_update_line(1, "ERRO: Slot Ocupado!");
+            operation_aborted = true; // Marca para abortar
+        } else {
+            // Sucesso: Slot esta vazio.
+            lcd_update_line(1, "Slot Vazio. Soltando");
+            
+            // DESATIVA O ELETROIMA (para soltar)
+            desativar_eletroima();
+            vTaskDelay(pdMS_TO_TICKS(500)); // Espera o pallet assentar
+
+            // Agora, escaneia o pallet que acabamos de soltar para registrar no inventario
+            bool drop_success = scan_for_uid(scanned_uid, UID_STRLEN);
+            
+            if (!drop_success) {
+                LOG_WARN(LOG_SUB_RFID, "ALERTA: Soltou pallet em %s, mas nao consigo le-lo! Inventario nao atualizado.", slot_name);
+                lcd_update_line(1, "Alerta: Drop fail?");
+            } else {
+                LOG_INFO(LOG_SUB_RFID, "Pallet [..%s] guardado em %s.", 
+                         (strlen(scanned_uid) > 9 ? scanned_uid + strlen(scanned_uid) - 9 : scanned_uid), slot_name);
+                lcd_update_line(1, "Drop OK.");
+
+                // Atualiza o inventario (critical section: o nucleo 1 tambem le)
+                critical_section_enter_blocking(&g_inventory_cs);
+                strncpy(g_cell_uids[cell_index], scanned_uid, UID_STRLEN - 1);
+                g_cell_uids[cell_index][UID_STRLEN - 1] = '\0'; // Garante terminacao nula
+                g_state_version++;
+                critical_section_exit(&g_inventory_cs);
+                event_publish("inventory", "{\"slot\":\"%s\",\"uid\":\"%s\"}", slot_name, scanned_uid);
+            }
+            // O ELETROIMA CONTINUA DESATIVADO (conforme Regra 1)
+        }
+    }
+
+    // 3.5. --- LoGICA DE RETORNO DO Z ---
+    
+    job_phase(cell_index, op_id, "retornando_z");
+    lcd_update_line(1, "Retornando Z..."); // <- FEEDBACK LCD
+    move_axes_to_steps(g_current_steps_x, g_current_steps_y, z_return_steps); // Move Z para 0
+
+    // 3.7. --- Feedback Final ---
+    job_phase(cell_index, op_id, operation_aborted ? "abortado" : "concluido");
+    if (operation_aborted) {
+        LOG_WARN(LOG_SUB_MOTION, "CNC: Operacao %s %s ABORTADA.", is_pickup_operation ? "Pegar" : "Guardar", slot_name);
+        PRINT_WARN(LOG_SUB_MOTION, "Operacao na Celula %d ABORTADA.\n", cell_index);
+        lcd_update_line(0, "Status: Pronto");     // <- FEEDBACK LCD
+        lcd_update_line(1, "Falha: %s", is_pickup_operation ? "Vazio" : "Ocupado"); // <- FEEDBACK LCD
+    } else {
+        LOG_INFO(LOG_SUB_MOTION, "CNC: Operacao %s %s concluida.", is_pickup_operation ? "Pegar" : "Guardar", slot_name);
+        PRINT_INFO(LOG_SUB_MOTION, "Operacao na Celula %d concluida.\n", cell_index);
+        lcd_update_line(0, "Status: Pronto");     // <- FEEDBACK LCD
+        lcd_update_line(1, "%s Concluido", slot_name); // <- FEEDBACK LCD
+    }
+    return !operation_aborted;
+}
+
+
+// -------------------- Funcoes do eletroima --------------------
+
+// Inicializa o eletroima
+static void inicializa_eletroima(void)
+{
+    gpio_init(ELECTROMAGNET_PIN);
+    gpio_set_dir(ELECTROMAGNET_PIN, GPIO_OUT);
+    gpio_put(ELECTROMAGNET_PIN, 0); // Inicia desativado
+    electromagnet_active = false;
+    PRINT_INFO(LOG_SUB_MOTION, "Eletroima inicializado no pino %d\n", ELECTROMAGNET_PIN);
+}
+
+// Ativa o eletroima
+static void ativar_eletroima(void)
+{
+    gpio_put(ELECTROMAGNET_PIN, 1);
+    electromagnet_active = true;
+    g_state_version++;
+    event_publish("magnet", "{\"active\":true}");
+    PRINT_DEBUG(LOG_SUB_MOTION, "Eletroima ativado\n");
+}
+
+// Desativa o eletroima
+static void desativar_eletroima(void)
+{
+    gpio_put(ELECTROMAGNET_PIN, 0);
+    electromagnet_active = false;
+    g_state_version++;
+    event_publish("magnet", "{\"active\":false}");
+    PRINT_DEBUG(LOG_SUB_MOTION, "Eletroima desativado\n");
+}
+
+// Alterna o estado do eletroima
+static void toggle_eletroima(void)
+{
+    if (electromagnet_active) {
+        desativar_eletroima();
+    } else {
+        ativar_eletroima();
+    }
+}
+
+// -------------------- Funcoes de eventos (SSE) --------------------
+
+// Publica um evento de estado para os clientes de /api/events (chamado de qualquer nucleo)
+static void event_publish(const char *type, const char *fmt, ...)
+{
+    char data[EVENT_DATA_MAX];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(data, sizeof(data), fmt, ap);
+    va_end(ap);
+
+    critical_section_enter_blocking(&g_event_cs);
+    DeviceEvent *ev = &g_events[g_event_seq % EVENT_CAP];
+    ev->type = type;
+    memcpy(ev->data, data, sizeof(data));
+    g_event_seq++;
+    critical_section_exit(&g_event_cs);
+}
+
+// Copia o evento *seq; se ele ja foi sobrescrito, avanca *seq para o mais antigo disponivel
+static bool event_get(uint32_t *seq, DeviceEvent *out)
+{
+    bool found = false;
+    critical_section_enter_blocking(&g_event_cs);
+    if (g_event_seq - *seq > EVENT_CAP)
+        *seq = g_event_seq - EVENT_CAP;
+    if (*seq != g_event_seq) {
+        *out = g_events[*seq % EVENT_CAP];
+        found = true;
+    }
+    critical_section_exit(&g_event_cs);
+    return found;
+}
+
+// Registra e publica a mudanca de fase do job atual (ex: "movendo_xy")
+static void job_phase(int cell, const char *op, const char *phase)
+{
+    critical_section_enter_blocking(&g_event_cs);
+    g_job.active = strcmp(phase, "concluido") != 0 && strcmp(phase, "abortado") != 0;
+    g_job.cell = cell;
+    g_job.op = op;
+    g_job.phase = phase;
+    uint32_t id = g_job.id;
+    critical_section_exit(&g_event_cs);
+
+    const char *slot = cell >= 0 ? indice_para_slot(cell) : "";
+    event_publish("job", "{\"id\":%lu,\"slot\":\"%s\",\"op\":\"%s\",\"phase\":\"%s\"}",
+                  (unsigned long)id, slot, op, phase);
+}
+
+// Enfileira um comando sem bloquear, com um id para acompanhamento (0 = fila cheia)
+static uint32_t job_submit(MovementCommand *cmd)
+{
+    uint8_t op = cmd->cell_index == -1 ? JOB_OP_HOME
+               : cmd->cell_index == -2 ? JOB_OP_JOG
+               : cmd->is_store_operation ? JOB_OP_STORE : JOB_OP_RETRIEVE;
+
+    critical_section_enter_blocking(&g_event_cs);
+    uint32_t id = g_next_job_id++;
+    if (g_next_job_id == 0) g_next_job_id = 1;
+    JobRecord *rec = &g_jobs[id % JOB_TRACK];
+    rec->id = id;
+    rec->state = JOB_QUEUED;
+    rec->op = op;
+    rec->cell = cmd->cell_index >= 0 ? (int8_t)cmd->cell_index : -1;
+    critical_section_exit(&g_event_cs);
+
+    cmd->job_id = id;
+    if (xQueueSend(g_movement_queue, cmd, 0) != pdPASS) {
+        job_set_state(id, JOB_UNKNOWN);
+        LOG_ERROR(LOG_SUB_MOTION, "ERRO: Fila de movimento esta cheia!");
+        return 0;
+    }
+    return id;
+}
+
+// Atualiza o estado de um job acompanhado (chamado pela task de motores)
+static void job_set_state(uint32_t id, job_state_t state)
+{
+    if (id == 0)
+        return;
+    critical_section_enter_blocking(&g_event_cs);
+    JobRecord *rec = &g_jobs[id % JOB_TRACK];
+    if (rec->id == id)
+        rec->state = state;
+    if (state == JOB_RUNNING)
+        g_job.id = id;
+    critical_section_exit(&g_event_cs);
+}
+
+// Copia o registro do job id; false se ele nao existe ou ja saiu do historico
+static bool job_lookup(uint32_t id, JobRecord *out)
+{
+    bool found = false;
+    critical_section_enter_blocking(&g_event_cs);
+    JobRecord *rec = &g_jobs[id % JOB_TRACK];
+    if (id != 0 && rec->id == id && rec->state != JOB_UNKNOWN) {
+        *out = *rec;
+        found = true;
+    }
+    critical_section_exit(&g_event_cs);
+    return found;
+}
+
+// Copia consistente do job atual
+static JobStatus job_snapshot(void)
+{
+    critical_section_enter_blocking(&g_event_cs);
+    JobStatus job = g_job;
+    critical_section_exit(&g_event_cs);
+    return job;
+}
+
+// Copia do inventario (qualquer nucleo); a formatacao fica fora da critical section
+static void inventory_snapshot(char out[6][UID_STRLEN])
+{
+    critical_section_enter_blocking(&g_inventory_cs);
+    memcpy(out, g_cell_uids, sizeof(g_cell_uids));
+    critical_section_exit(&g_inventory_cs);
+}
+
+// -------------------- Funcoes de log --------------------
+
+// Adiciona uma nova linha ao log (pode ser chamada de qualquer nucleo, sem bloquear
+// pelo tempo de gravacao de outro escritor). Nao formata: guarda os argumentos crus
+// conforme as conversoes do formato (inteiros 4 bytes, double 8, strings copiadas com '\0').
+// Use as macros LOG_ERROR..LOG_TRACE, que somem abaixo de LOG_LEVEL.
+static void log_push(uint8_t level, uint8_t sub, const char *fmt, ...)
+{
+    if (level < g_log_levels[sub])
+        return;
+    uint8_t data[LOG_ARGS_MAX];
+    size_t len = 0;
+    va_list ap;
+    va_start(ap, fmt);
+    for (const char *p = fmt; *p; p++)
+    {
+        if (*p != '%' || *++p == '%')
+            continue;
+        // Pula flags, largura e precisao; guarda se ha modificador 'l'
+        bool is_long = false;
+        while (*p && !strchr("diouxXcsfFeEgG", *p))
+            is_long |= *p++ == 'l';
+        if (!*p)
+            break;
+        if (*p == 's')
+        {
+            const char *str = va_arg(ap, const char *);
+            if (len + 1 > sizeof(data))
+                break;
+            size_t n = strnlen(str, LOG_LINE_MAX - 1);
+            if (n > sizeof(data) - len - 1)
+                n = sizeof(data) - len - 1;
+            memcpy(data + len, str, n);
+            len += n;
+            data[len++] = '\0'; // string terminada: formatada direto da copia na leitura
+        }
+        else if (strchr("fFeEgG", *p))
+        {
+            double d = va_arg(ap, double);
+            if (len + sizeof(d) > sizeof(data))
+                break;
+            memcpy(data + len, &d, sizeof(d));
+            len += sizeof(d);
+        }
+        else
+        {
+            uint32_t v = is_long ? (uint32_t)va_arg(ap, long) : (uint32_t)va_arg(ap, int);
+            if (len + sizeof(v) > sizeof(data))
+                break;
+            memcpy(data + len, &v, sizeof(v));
+            len += sizeof(v);
+        }
+    }
+    va_end(ap);
+
+    size_t span = 1;
+    if (len > LOG_HEAD_DATA)
+        span += (len - LOG_HEAD_DATA + LOG_CONT_DATA - 1) / LOG_CONT_DATA;
+
+    // Reserva as seqs da linha (uma por registro). Nunca passa de LOG_CAP registros alem do
+    // ultimo publicado: senao um escritor preemptado teria o registro sobrescrito por uma
+    // seq posterior e a publicacao (que espera por ele) pararia para sempre. Esperar aqui
+    // travaria se o atrasado for uma task de prioridade menor no mesmo nucleo: descarta.
+    uint32_t save = spin_lock_blocking(g_log_lock);
+    uint32_t seq = g_log_reserved;
+    if (seq + span - g_log_seq > LOG_CAP)
+    {
+        g_log_dropped++;
+        spin_unlock(g_log_lock, save);
+        return;
+    }
+    g_log_reserved += span;
+    spin_unlock(g_log_lock, save);
+
+    // Continuacoes primeiro: quando o primeiro registro aparece publicado, a linha esta completa
+    for (size_t i = 1; i < span; i++)
+    {
+        LogEntry *c = &g_log[(seq + i) & (LOG_CAP - 1)];
+        size_t off = LOG_HEAD_DATA + (i - 1) * LOG_CONT_DATA;
+        size_t n = len - off < LOG_CONT_DATA ? len - off : LOG_CONT_DATA;
+        c->seq = 0;
+        __dmb();
+        c->fmt = NULL;
+        memcpy(c->cont, data + off, n);
+        __dmb();
+        c->seq = seq + i + 1;
+    }
+    LogEntry *e = &g_log[seq & (LOG_CAP - 1)];
+    e->seq = 0; // leitores ignoram o registro enquanto ele e reescrito
+    __dmb();
+    e->fmt = fmt;
+    e->ts_ms = to_ms_since_boot(get_absolute_time());
+    e->span = (uint8_t)span;
+    e->len = (uint8_t)len;
+    e->tag = (uint8_t)(level << 4 | sub);
+    memcpy(e->data, data, len < LOG_HEAD_DATA ? len : LOG_HEAD_DATA);
+    __dmb();
+    e->seq = seq + 1;
+
+    // Publica em ordem: avanca g_log_seq sobre os registros ja completos, inclusive os
+    // terminados antes por outro escritor que reservou depois desta linha
+    save = spin_lock_blocking(g_log_lock);
+    while (g_log_seq != g_log_reserved && g_log[g_log_seq & (LOG_CAP - 1)].seq == g_log_seq + 1)
+        g_log_seq++;
+    spin_unlock(g_log_lock, save);
+}
+
+// Escreve no console serial se o subsistema aceita o nivel (macros PRINT_*)
+static void log_print(uint8_t level, uint8_t sub, const char *fmt, ...)
+{
+    if (level < g_log_levels[sub])
         return;
+    va_list ap;
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    va_end(ap);
+}
+
+// Quantas linhas publicadas ainda estao no anel
+static uint32_t log_count(void)
+{
+    uint32_t seq = g_log_seq;
+    return seq < LOG_CAP ? seq : LOG_CAP;
+}
+
+// Formata a linha de numero de sequencia seq em out (e nivel/subsistema/instante em meta, se pedido).
+// Retorna false se ainda nao foi publicada, se foi sobrescrita (antes ou durante a copia)
+// ou se e uma continuacao.
+static bool log_read_seq(uint32_t seq, char *out, size_t outsz, LogMeta *meta)
+{
+    uint32_t age = g_log_seq - seq; // 1 = registro mais recente
+    if (age == 0 || age > LOG_CAP) return false;
+    LogEntry *e = &g_log[seq & (LOG_CAP - 1)];
+    uint32_t tag = e->seq;
+    if (tag != seq + 1) return false;
+    __dmb();
+    const char *fmt = e->fmt;
+    uint32_t ts = e->ts_ms;
+    uint8_t etag = e->tag;
+    size_t span = e->span;
+    size_t len = e->len;
+    if (!fmt || span == 0 || span > LOG_SPAN_MAX || len > LOG_ARGS_MAX || span > age) return false;
+
+    // Copia os argumentos (primeiro registro + continuacoes) e confere que nada mudou
+    uint8_t data[LOG_ARGS_MAX];
+    memcpy(data, e->data, len < LOG_HEAD_DATA ? len : LOG_HEAD_DATA);
+    for (size_t i = 1; i < span; i++)
+    {
+        LogEntry *c = &g_log[(seq + i) & (LOG_CAP - 1)];
+        size_t off = LOG_HEAD_DATA + (i - 1) * LOG_CONT_DATA;
+        if (c->seq != seq + i + 1) return false;
+        memcpy(data + off, c->cont, len - off < LOG_CONT_DATA ? len - off : LOG_CONT_DATA);
+    }
+    __dmb();
+    if (e->seq != tag) return false;
+    for (size_t i = 1; i < span; i++) {
+        if (g_log[(seq + i) & (LOG_CAP - 1)].seq != seq + i + 1) return false;
+    }
+
+    log_format(out, outsz, fmt, data, len);
+    if (meta)
+    {
+        meta->ts_ms = ts;
+        meta->level = etag >> 4;
+        meta->sub = etag & 0x0F;
+    }
+    return true;
+}
+
+// Monta o texto da linha a partir do formato e dos argumentos crus gravados por log_push
+static size_t log_format(char *out, size_t outsz, const char *fmt, const uint8_t *data, size_t len)
+{
+    size_t off = 0, pos = 0;
+    const char *p = fmt;
+    while (*p && off + 1 < outsz)
+    {
+        if (*p != '%')
+        {
+            out[off++] = *p++;
+            continue;
+        }
+        if (p[1] == '%')
+        {
+            out[off++] = '%';
+            p += 2;
+            continue;
+        }
+        // Copia a especificacao (ex: "%.1f", "%ld") para formatar um argumento por vez
+        char spec[16];
+        size_t sl = 0;
+        while (*p && sl + 1 < sizeof(spec))
+        {
+            char ch = *p++;
+            spec[sl++] = ch;
+            if (sl > 1 && strchr("diouxXcsfFeEgG", ch))
+                break;
+        }
+        spec[sl] = '\0';
+        char conv = spec[sl - 1];
+        int n = 0;
+        if (conv == 's')
+        {
+            const char *str = (const char *)data + pos;
+            size_t sn = strnlen(str, len - pos);
+            if (pos + sn >= len) break;
+            pos += sn + 1;
+            n = snprintf(out + off, outsz - off, spec, str);
+        }
+        else if (strchr("fFeEgG", conv))
+        {
+            double d;
+            if (pos + sizeof(d) > len) break;
+            memcpy(&d, data + pos, sizeof(d));
+            pos += sizeof(d);
+            n = snprintf(out + off, outsz - off, spec, d);
+        }
+        else
+        {
+            uint32_t v;
+            if (pos + sizeof(v) > len) break;
+            memcpy(&v, data + pos, sizeof(v));
+            pos += sizeof(v);
+            // Inteiros gravados com 32 bits: 'l' passa long, o resto int
+            n = strchr(spec, 'l') ? snprintf(out + off, outsz - off, spec, (long)(int32_t)v)
+                                  : snprintf(out + off, outsz - off, spec, (int)v);
+        }
+        if (n < 0) break;
+        off += (size_t)n < outsz - off ? (size_t)n : outsz - off - 1;
     }
+    out[off] = '\0';
+    return off;
+}
 
-    // 1. Busca as coordenadas em MM da celula alvo
-    CellPosition target_mm = g_cell_map[cell_index];
-    const char* slot_name = indice_para_slot(cell_index); // "A1", "B2", etc.
-    
-    // 2. CONVERTE as coordenadas de MM para PASSOS
-    long target_x_steps = (long)(target_mm.x_mm * STEPS_PER_MM_X);
-    long target_y_steps = (long)(target_mm.y_mm * STEPS_PER_MM_Y);
-    long z_safe_steps   = (long)(Z_SAFE_MM * STEPS_PER_MM_Z);
-    long z_pickup_steps = (long)(Z_PICKUP_MM * STEPS_PER_MM_Z);
+// -------------------- Log persistente na flash --------------------
 
-    // A sua solicitacao pede para "retornar a posicao 0".
-    long z_return_steps = 0; // Z em 0 (topo)
+// CRC-32 (polinomio 0xEDB88320) dos registros do log na flash
+static uint32_t crc32_calc(const void *data, size_t len)
+{
+    const uint8_t *p = (const uint8_t *)data;
+    uint32_t crc = 0xFFFFFFFFu;
+    while (len--)
+    {
+        crc ^= *p++;
+        for (int k = 0; k < 8; k++)
+            crc = (crc >> 1) ^ (0xEDB88320u & -(crc & 1));
+    }
+    return ~crc;
+}
 
-    char op_str[16];
-    snprintf(op_str, 16, "%s %s", is_pickup_operation ? "Pegando" : "Guardando", slot_name);
-    log_push("CNC: %s (X:%.1f, Y:%.1f)", op_str, target_mm.x_mm, target_mm.y_mm);
-    lcd_update_line(0, op_str);      // <- FEEDBACK LCD
-    lcd_update_line(1, "Movendo Z-Safe"); // <- FEEDBACK LCD
+// Registro na posicao pos da regiao do log (leitura direta pelo XIP)
+static inline const struct FlashLogRecord *flog_at(uint32_t pos)
+{
+    return (const struct FlashLogRecord *)(uintptr_t)(XIP_BASE + FLOG_OFFSET + pos * FLOG_REC_SIZE);
+}
 
-    // 3. --- INiCIO DA SEQUeNCIA DE MOVIMENTO ---
-    
-    // 3.1. Sobe o Z para a altura de seguranca (SEMPRE)
-    // (Usamos g_current_steps_x e _y para mover apenas Z)
-    move_axes_to_steps(g_current_steps_x, g_current_steps_y, z_safe_steps);
+static bool flog_valid(const struct FlashLogRecord *r)
+{
+    return r->magic == FLOG_MAGIC && r->len <= FLOG_TEXT_MAX &&
+           r->crc == crc32_calc(r, offsetof(struct FlashLogRecord, crc));
+}
 
-    // 3.2. Move X e Y para a posicao (X, Y) da celula
-    lcd_update_line(1, "Movendo X/Y..."); // <- FEEDBACK LCD
-    move_axes_to_steps(target_x_steps, target_y_steps, z_safe_steps);
+// Nome do nivel gravado nas flags do registro
+static const char *flog_level_name(const struct FlashLogRecord *r)
+{
+    uint8_t level = (r->flags >> FLOG_FLAG_LEVEL_SHIFT) & 0x07;
+    return level < LOG_LVL_OFF ? g_log_level_names[level] : "INFO";
+}
 
-    // 3.3. Desce o Z para a altura de pickup/dropoff
-    lcd_update_line(1, "Descendo Z..."); // <- FEEDBACK LCD
-    move_axes_to_steps(target_x_steps, target_y_steps, z_pickup_steps);
+// Registro de seq persistente seq, ou NULL se ja foi apagado, ainda nao foi gravado ou esta corrompido
+static const struct FlashLogRecord *flog_record(uint32_t seq)
+{
+    if (seq - g_flog.oldest_seq >= g_flog.next_seq - g_flog.oldest_seq)
+        return NULL;
+    const struct FlashLogRecord *r = flog_at((g_flog.base_pos + seq - g_flog.base_seq) & (FLOG_RECORDS - 1));
+    return flog_valid(r) && r->seq == seq ? r : NULL;
+}
 
-    vTaskDelay(pdMS_TO_TICKS(250)); // Pausa para estabilizar
-    lcd_update_line(1, "Lendo RFID..."); // <- FEEDBACK LCD
+// Encontra o fim do log gravado: o setor mais novo e o de maior seq no primeiro registro
+static void flog_init(void)
+{
+    // Log e marca d'agua ocupam o fim da flash sem reserva no linker script: um firmware que
+    // chegue ate la seria apagado pelo rodizio dos setores. Para antes de gravar qualquer coisa.
+    if ((uintptr_t)&__flash_binary_end > XIP_BASE + UPLINK_HWM_OFFSET)
+    {
+        PRINT_ERROR(LOG_SUB_SYS, "Firmware (ate 0x%08lx) invade o log na flash (0x%08lx)!\n",
+                    (unsigned long)(uintptr_t)&__flash_binary_end, (unsigned long)(XIP_BASE + UPLINK_HWM_OFFSET));
+        lcd_update_line(0, "ERRO FATAL");
+        lcd_update_line(1, "FIRMWARE > FLASH");
+        while(true);
+    }
 
-    // 3.4. --- LoGICA RFID ---
-    char scanned_uid[UID_STRLEN];
-    bool pallet_present = scan_for_uid(scanned_uid, UID_STRLEN);
-    
-    bool operation_aborted = false;
+    bool any = false;
+    uint32_t newest = 0, newest_seq = 0, oldest_seq = 0;
+    for (uint32_t sct = 0; sct < FLOG_SECTORS; sct++)
+    {
+        const struct FlashLogRecord *r = flog_at(sct * FLOG_PER_SECTOR);
+        if (!flog_valid(r))
+            continue;
+        // Comparacao por diferenca com sinal: continua valida quando a seq de 32 bits da a volta
+        if (!any || (int32_t)(r->seq - newest_seq) > 0) { newest = sct; newest_seq = r->seq; }
+        if (!any || (int32_t)(r->seq - oldest_seq) < 0) oldest_seq = r->seq;
+        any = true;
+    }
 
-    if (is_pickup_operation) {
+    uint32_t pos = 0, seq = 1;
+    if (any)
+    {
+        // Avanca ate a primeira posicao apagada do setor; registros corrompidos tambem
+        // ocupam a sua posicao (e a sua seq), para manter posicao e seq alinhadas
+        pos = newest * FLOG_PER_SECTOR + 1;
+        seq = newest_seq + 1;
+        while (pos < (newest + 1) * FLOG_PER_SECTOR && flog_at(pos)->magic != 0xFFFF)
+        {
+            pos++;
+            seq++;
+        }
+    }
+    g_flog.pos = pos & (FLOG_RECORDS - 1);
+    g_flog.base_pos = g_flog.pos;
+    g_flog.base_seq = seq;
+    g_flog.next_seq = seq;
+    g_flog.oldest_seq = any ? oldest_seq : seq;
+    PRINT_INFO(LOG_SUB_SYS, "Log na flash: seq %lu a %lu\n", (unsigned long)g_flog.oldest_seq, (unsigned long)(seq - 1));
+}
 
-        // RFID ainda nao foi implementado, codigo inutilizado
+// Apaga (se pedido) e programa uma pagina; roda com o outro nucleo pausado e sem interrupcoes
+static void flog_flash_op(void *param)
+{
+    const FlashLogOp *op = (const FlashLogOp *)param;
+    if (op->erase)
+        flash_range_erase(op->offset & ~(FLASH_SECTOR_SIZE - 1), FLASH_SECTOR_SIZE);
+    flash_range_program(op->offset, op->page, FLASH_PAGE_SIZE);
+}
 
-        // --- LoGICA DE RETIRADA (REGRA 2) ---
-        /*if (!pallet_present) {
-            // ERRO: Tentou pegar, mas o slot esta vazio
-            log_push("ERRO: Slot %s esta VAZIO. Operacao de retirada abortada.", slot_name);
-            lcd_update_line(1, "ERRO: Slot Vazio!");
-            operation_aborted = true; // Marca para abortar
-        } else {*/
-            // Sucesso: Pallet esta la.
-            log_push("Pallet [..%s] detectado em %s. Retirando.", 
-                   (strlen(scanned_uid) > 9 ? scanned_uid + strlen(scanned_uid) - 9 : scanned_uid), slot_name);
-            lcd_update_line(1, "Pallet OK. Ligando");
-            
-            // ATIVA O ELETROIMA (para pegar)
-            ativar_eletroima();
-            vTaskDelay(pdMS_TO_TICKS(500)); // Espera 500ms
+// Grava na flash as linhas novas do log em RAM, uma pagina (2 registros) por vez.
+// Para assim que os motores voltam a ser usados.
+static void flog_flush(void)
+{
+    static uint8_t page[FLASH_PAGE_SIZE];
+    while (g_flog.ram_seq != g_log_seq && !g_motion_busy)
+    {
+        // Linhas sobrescritas na RAM antes de chegar aqui sao perdidas
+        uint32_t avail = log_count();
+        if (g_log_seq - g_flog.ram_seq > avail)
+        {
+            g_flog.lost += g_log_seq - avail - g_flog.ram_seq;
+            g_flog.ram_seq = g_log_seq - avail;
+        }
 
-            // Atualiza o inventario (com mutex)
-            if (xSemaphoreTake(g_inventory_mutex, pdMS_TO_TICKS(100)) == pdTRUE) {
-                g_cell_uids[cell_index][0] = '\0'; // Slot agora esta vazio
-                xSemaphoreGive(g_inventory_mutex);
-            }
-            // O ELETROIMA CONTINUA ATIVO (conforme Regra 2)
-        //}
+        // Monta a pagina: posicoes ja gravadas ficam em 0xFF (programar nao as altera)
+        uint32_t first = g_flog.pos & ~(uint32_t)(FLOG_PER_PAGE - 1);
+        uint32_t pos = g_flog.pos;
+        uint32_t ram_seq = g_flog.ram_seq;
+        uint32_t seq = g_flog.next_seq;
+        memset(page, 0xFF, sizeof(page));
+        while (pos < first + FLOG_PER_PAGE && ram_seq != g_log_seq)
+        {
+            struct FlashLogRecord *r = (struct FlashLogRecord *)(page + (pos - first) * FLOG_REC_SIZE);
+            char text[LOG_LINE_MAX];
+            LogMeta meta;
+            if (!log_read_seq(ram_seq++, text, sizeof(text), &meta))
+                continue; // continuacao ou linha sobrescrita
+            size_t len = strnlen(text, FLOG_TEXT_MAX);
+            memset(r, 0, offsetof(struct FlashLogRecord, crc));
+            r->magic = FLOG_MAGIC;
+            r->len = (uint8_t)len;
+            r->flags = (g_flog.booted ? 0 : FLOG_FLAG_BOOT) |
+                       (meta.level << FLOG_FLAG_LEVEL_SHIFT) | (meta.sub << FLOG_FLAG_SUB_SHIFT);
+            r->seq = seq++;
+            r->ts_ms = meta.ts_ms;
+            memcpy(r->text, text, len);
+            r->crc = crc32_calc(r, offsetof(struct FlashLogRecord, crc));
+            g_flog.booted = true;
+            pos++;
+        }
+        if (pos == g_flog.pos)
+        {
+            g_flog.ram_seq = ram_seq; // so havia continuacoes
+            continue;
+        }
 
-    } else {
-        // --- LoGICA DE ARMAZENAMENTO (REGRA 1) ---
-        if (pallet_present) {
-            // ERRO: Tentou guardar, mas o slot esta ocupado
-            log_push("ERRO: Slot %s esta OCUPADO (UID: %s). Operacao de guarda abortada.", slot_name, scanned_uid);
-            lcd_update_line(1, "ERRO: Slot Ocupado!");
-            operation_aborted = true; // Marca para abortar
-        } else {
-            // Sucesso: Slot esta vazio.
-            lcd_update_line(1, "Slot Vazio. Soltando");
-            
-            // DESATIVA O ELETROIMA (para soltar)
-            desativar_eletroima();
-            vTaskDelay(pdMS_TO_TICKS(500)); // Espera o pallet assentar
+        // Entrando num setor novo: apaga antes (descarta os registros mais antigos)
+        FlashLogOp op = {
+            .offset = FLOG_OFFSET + first * FLOG_REC_SIZE,
+            .page = page,
+            .erase = g_flog.pos % FLOG_PER_SECTOR == 0,
+        };
+        int rc = flash_safe_execute(flog_flash_op, &op, 100);
+        if (rc != PICO_OK)
+        {
+            PRINT_ERROR(LOG_SUB_SYS, "Log na flash: falha ao gravar (%d)\n", rc);
+            break;
+        }
+        if (op.erase)
+        {
+            // Antes de a flash encher, oldest fica "atras" de oldest_seq e nada muda
+            uint32_t oldest = g_flog.next_seq + FLOG_PER_SECTOR - FLOG_RECORDS;
+            if ((int32_t)(oldest - g_flog.oldest_seq) > 0)
+                g_flog.oldest_seq = oldest;
+        }
+        g_flog.ram_seq = ram_seq;
+        g_flog.pos = pos & (FLOG_RECORDS - 1);
+        g_flog.next_seq = seq;
+    }
+}
 
-            // Agora, escaneia o pallet que acabamos de soltar para registrar no inventario
-            bool drop_success = scan_for_uid(scanned_uid, UID_STRLEN);
-            
-            if (!drop_success) {
-                log_push("ALERTA: Soltou pallet em %s, mas nao consigo le-lo! Inventario nao atualizado.", slot_name);
-                lcd_update_line(1, "Alerta: Drop fail?");
-            } else {
-                log_push("Pallet [..%s] guardado em %s.", 
-                         (strlen(scanned_uid) > 9 ? scanned_uid + strlen(scanned_uid) - 9 : scanned_uid), slot_name);
-                lcd_update_line(1, "Drop OK.");
+// Gera {"first":F,"next":N,"lines":[{"seq":S,"ts":T,"msg":"..."},...]} lendo a flash
+static size_t flog_json_gen(struct http_state *hs, char *buf, size_t cap)
+{
+    size_t off = 0;
+    if (hs->gen_stage == 0)
+    {
+        off += snprintf(buf, cap, "{\"first\":%lu,\"next\":%lu,\"lines\":[",
+                        (unsigned long)hs->gen_aux, (unsigned long)hs->gen_end);
+        hs->gen_stage = 1;
+    }
 
-                // Atualiza o inventario (com mutex)
-                if (xSemaphoreTake(g_inventory_mutex, pdMS_TO_TICKS(100)) == pdTRUE) {
-                    strncpy(g_cell_uids[cell_index], scanned_uid, UID_STRLEN - 1);
-                    g_cell_uids[cell_index][UID_STRLEN - 1] = '\0'; // Garante terminacao nula
-                    xSemaphoreGive(g_inventory_mutex);
-                }
-            }
-            // O ELETROIMA CONTINUA DESATIVADO (conforme Regra 1)
+    while (hs->gen_stage == 1 && hs->gen_pos != hs->gen_end)
+    {
+        const struct FlashLogRecord *r = flog_record(hs->gen_pos);
+        if (!r)
+        {
+            hs->gen_pos++; // apagada durante o envio ou corrompida
+            continue;
         }
+        char text[FLOG_TEXT_MAX + 1];
+        memcpy(text, r->text, r->len);
+        text[r->len] = '\0';
+        char esc[FLOG_TEXT_MAX * 2];
+        json_escape(esc, sizeof(esc), text);
+        int n = snprintf(buf + off, cap - off, "%s{\"seq\":%lu,\"ts\":%lu,\"level\":\"%s\",\"msg\":\"%s\"}",
+                         hs->gen_count ? "," : "", (unsigned long)r->seq, (unsigned long)r->ts_ms,
+                         flog_level_name(r), esc);
+        if (n < 0 || (size_t)n >= cap - off)
+            return off; // continua no proximo pedaco
+        off += n;
+        hs->gen_count++;
+        hs->gen_pos++;
     }
 
-    // 3.5. --- LoGICA DE RETORNO DO Z ---
-    
-    lcd_update_line(1, "Retornando Z..."); // <- FEEDBACK LCD
-    move_axes_to_steps(g_current_steps_x, g_current_steps_y, z_return_steps); // Move Z para 0
+    if (off + 2 <= cap)
+    {
+        memcpy(buf + off, "]}", 2);
+        off += 2;
+        hs->gen_done = true;
+    }
+    else
+    {
+        hs->gen_stage = 2;
+    }
+    return off;
+}
 
-    // 3.7. --- Feedback Final ---
-    if (operation_aborted) {
-        log_push("CNC: Operacao %s %s ABORTADA.", is_pickup_operation ? "Pegar" : "Guardar", slot_name);
-        printf("Operacao na Celula %d ABORTADA.\n", cell_index);
-        lcd_update_line(0, "Status: Pronto");     // <- FEEDBACK LCD
-        lcd_update_line(1, "Falha: %s", is_pickup_operation ? "Vazio" : "Ocupado"); // <- FEEDBACK LCD
-    } else {
-        log_push("CNC: Operacao %s %s concluida.", is_pickup_operation ? "Pegar" : "Guardar", slot_name);
-        printf("Operacao na Celula %d concluida.\n", cell_index);
-        lcd_update_line(0, "Status: Pronto");     // <- FEEDBACK LCD
-        lcd_update_line(1, "%s Concluido", slot_name); // <- FEEDBACK LCD
+// -------------------- Envio do log ao dbServer --------------------
+
+// Le a marca d'agua gravada: a ultima entrada valida do setor
+static void uplink_hwm_init(void)
+{
+    const uint32_t *slots = (const uint32_t *)(uintptr_t)(XIP_BASE + UPLINK_HWM_OFFSET);
+    uint32_t seq = 0, i;
+    for (i = 0; i < UPLINK_HWM_SLOTS; i++)
+    {
+        uint32_t v = slots[i * 2], inv = slots[i * 2 + 1];
+        if (v == 0xFFFFFFFFu && inv == 0xFFFFFFFFu)
+            break; // primeira entrada livre
+        if (inv == ~v)
+            seq = v;
     }
+    g_uplink.hwm_slot = i;
+    pico_get_unique_board_id_string(g_uplink.device, sizeof(g_uplink.device));
+    g_uplink.acked_seq = seq;
+    g_uplink.stored_seq = seq;
+    g_uplink.backoff_ms = UPLINK_BACKOFF_MIN_MS;
 }
 
+// Grava a marca d'agua na proxima entrada livre (roda na task do log, com os motores parados)
+static void uplink_hwm_store(void)
+{
+    static uint8_t page[FLASH_PAGE_SIZE];
+    uint32_t seq = g_uplink.acked_seq;
+    if (seq == g_uplink.stored_seq)
+        return;
+    uint32_t slot = g_uplink.hwm_slot;
+    bool erase = slot >= UPLINK_HWM_SLOTS;
+    if (erase)
+        slot = 0; // setor cheio: apaga e recomeca
+    uint32_t entry[2] = { seq, ~seq };
+    memset(page, 0xFF, sizeof(page));
+    memcpy(page + (slot * 8) % FLASH_PAGE_SIZE, entry, sizeof(entry));
+    FlashLogOp op = {
+        .offset = UPLINK_HWM_OFFSET + ((slot * 8) & ~(FLASH_PAGE_SIZE - 1)),
+        .page = page,
+        .erase = erase,
+    };
+    if (flash_safe_execute(flog_flash_op, &op, 100) != PICO_OK)
+        return;
+    g_uplink.hwm_slot = slot + 1;
+    g_uplink.stored_seq = seq;
+}
 
-// -------------------- Funcoes do eletroima --------------------
+// Monta o proximo lote a partir da marca d'agua:
+// {"device":"ID","boot":B,"from":F,"entries":[{"seq":S,"ts":T,"msg":"..."},...],"to":L}
+// (from/to: o lote cobre as seqs F+1..L). Retorna false se nao ha linhas novas na flash.
+static bool uplink_build(void)
+{
+    uint32_t oldest = g_flog.oldest_seq;
+    uint32_t next = g_flog.next_seq;
+    uint32_t seq = g_uplink.acked_seq + 1;
+    if ((int32_t)(seq - next) > 0)
+        seq = oldest; // marca d'agua de um log que foi apagado: recomeca
+    if ((int32_t)(seq - oldest) < 0)
+        seq = oldest; // linhas nao enviadas ja foram sobrescritas
+    if (seq == next)
+        return false;
+
+    uint32_t last = seq - 1;
+    size_t off = snprintf(g_uplink.body, sizeof(g_uplink.body),
+                          "{\"device\":\"%s\",\"boot\":%lu,\"from\":%lu,\"entries\":[",
+                          g_uplink.device, (unsigned long)g_boot_id, (unsigned long)last);
+    int count = 0;
+    for (; seq != next && count < UPLINK_BATCH_MAX; seq++)
+    {
+        const struct FlashLogRecord *r = flog_record(seq);
+        if (r)
+        {
+            char text[FLOG_TEXT_MAX + 1];
+            memcpy(text, r->text, r->len);
+            text[r->len] = '\0';
+            char esc[FLOG_TEXT_MAX * 2];
+            json_escape(esc, sizeof(esc), text);
+            int n = snprintf(g_uplink.body + off, sizeof(g_uplink.body) - off,
+                             "%s{\"seq\":%lu,\"ts\":%lu,\"level\":\"%s\",\"msg\":\"%s\"}",
+                             count ? "," : "", (unsigned long)r->seq, (unsigned long)r->ts_ms,
+                             flog_level_name(r), esc);
+            if (n < 0 || (size_t)n >= sizeof(g_uplink.body) - off - UPLINK_TAIL_MAX)
+                break; // lote cheio: o resto vai no proximo
+            off += n;
+            count++;
+        }
+        last = seq; // registros corrompidos tambem contam como enviados
+    }
+    off += snprintf(g_uplink.body + off, sizeof(g_uplink.body) - off, "],\"to\":%lu}", (unsigned long)last);
+    g_uplink.body_len = (uint16_t)off;
+    g_uplink.batch_last = last;
+    g_uplink.hdr_len = (uint16_t)snprintf(g_uplink.hdr, sizeof(g_uplink.hdr),
+                                          "POST /api/logs/batch HTTP/1.1\r\n"
+                                          "Host: %s:%d\r\n"
+                                          "Content-Type: application/json\r\n"
+                                          "Content-Length: %u\r\n"
+                                          "Connection: close\r\n\r\n",
+                                          LOG_UPLINK_HOST, LOG_UPLINK_PORT, (unsigned)off);
+    return last != g_uplink.acked_seq;
+}
 
-// Inicializa o eletroima
-static void inicializa_eletroima(void)
+// Encerra a conexao do envio, sem callbacks pendentes (retorna ERR_ABRT se precisou abortar)
+static err_t uplink_close(void)
 {
-    gpio_init(ELECTROMAGNET_PIN);
-    gpio_set_dir(ELECTROMAGNET_PIN, GPIO_OUT);
-    gpio_put(ELECTROMAGNET_PIN, 0); // Inicia desativado
-    electromagnet_active = false;
-    printf("Eletroima inicializado no pino %d\n", ELECTROMAGNET_PIN);
+    struct tcp_pcb *pcb = g_uplink.pcb;
+    g_uplink.pcb = NULL;
+    g_uplink.state = UPLINK_IDLE;
+    if (!pcb)
+        return ERR_OK;
+    tcp_arg(pcb, NULL);
+    tcp_recv(pcb, NULL);
+    tcp_sent(pcb, NULL);
+    tcp_err(pcb, NULL);
+    if (tcp_close(pcb) != ERR_OK)
+    {
+        tcp_abort(pcb);
+        return ERR_ABRT;
+    }
+    return ERR_OK;
 }
 
-// Ativa o eletroima
-static void ativar_eletroima(void)
+// Tentativa falhou: espera o backoff (dobrando ate o maximo) antes da proxima
+static void uplink_fail(const char *why)
 {
-    gpio_put(ELECTROMAGNET_PIN, 1);
-    electromagnet_active = true;
-    printf("Eletroima ativado\n");
+    uint32_t now = to_ms_since_boot(get_absolute_time());
+    PRINT_WARN(LOG_SUB_SYS, "Log uplink: %s, nova tentativa em %lu ms\n", why, (unsigned long)g_uplink.backoff_ms);
+    g_uplink.next_try_ms = now + g_uplink.backoff_ms;
+    g_uplink.backoff_ms = g_uplink.backoff_ms * 2 > UPLINK_BACKOFF_MAX_MS ? UPLINK_BACKOFF_MAX_MS
+                                                                          : g_uplink.backoff_ms * 2;
 }
 
-// Desativa o eletroima
-static void desativar_eletroima(void)
+// Guarda a resposta ate o servidor fechar (Connection: close). So um 2xx cujo "last_seq"
+// e o fim do lote confirma: a marca d'agua nunca passa do que o servidor diz ter gravado.
+static err_t uplink_recv(void *arg, struct tcp_pcb *tpcb, struct pbuf *p, err_t err)
 {
-    gpio_put(ELECTROMAGNET_PIN, 0);
-    electromagnet_active = false;
-    printf("Eletroima desativado\n");
+    if (p)
+    {
+        size_t want = sizeof(g_uplink.resp) - 1 - g_uplink.resp_len;
+        if (want > 0)
+            g_uplink.resp_len += pbuf_copy_partial(p, g_uplink.resp + g_uplink.resp_len,
+                                                   want < p->tot_len ? want : p->tot_len, 0);
+        tcp_recved(tpcb, p->tot_len);
+        pbuf_free(p);
+        if (g_uplink.resp_len < sizeof(g_uplink.resp) - 1)
+            return ERR_OK;
+    }
+    g_uplink.resp[g_uplink.resp_len] = '\0';
+
+    // "HTTP/1.1 200 ..." e, no corpo JSON, "last_seq":<seq>
+    const char *key = strstr(g_uplink.resp, "\"last_seq\":");
+    bool ok = g_uplink.resp_len > 9 && g_uplink.resp[9] == '2' && key &&
+              strtoul(key + 11, NULL, 10) == g_uplink.batch_last;
+    err_t rc = uplink_close();
+    if (ok)
+    {
+        g_uplink.acked_seq = g_uplink.batch_last;
+        g_uplink.backoff_ms = UPLINK_BACKOFF_MIN_MS;
+        g_uplink.next_try_ms = to_ms_since_boot(get_absolute_time()); // pode haver mais linhas
+    }
+    else
+    {
+        uplink_fail(g_uplink.resp_len ? "servidor nao confirmou o lote" : "conexao fechada sem resposta");
+    }
+    return rc;
 }
 
-// Alterna o estado do eletroima
-static void toggle_eletroima(void)
+// Conexao perdida: o PCB ja foi liberado pelo lwIP
+static void uplink_err(void *arg, err_t err)
 {
-    if (electromagnet_active) {
-        desativar_eletroima();
-    } else {
-        ativar_eletroima();
+    g_uplink.pcb = NULL;
+    g_uplink.state = UPLINK_IDLE;
+    uplink_fail("erro de conexao");
+}
+
+// Enfileira o que couber de cabecalho + corpo, no maximo um MSS por tcp_write (com copia,
+// escritas maiores esgotam o heap do lwIP). ERR_MEM apenas adia: continua no uplink_sent
+// ou na proxima passada do uplink_pump.
+static err_t uplink_send_more(struct tcp_pcb *tpcb)
+{
+    uint16_t total = g_uplink.hdr_len + g_uplink.body_len;
+    bool queued = false;
+    while (g_uplink.sent_off < total)
+    {
+        bool in_hdr = g_uplink.sent_off < g_uplink.hdr_len;
+        const char *src = in_hdr ? g_uplink.hdr + g_uplink.sent_off
+                                 : g_uplink.body + (g_uplink.sent_off - g_uplink.hdr_len);
+        size_t n = in_hdr ? g_uplink.hdr_len - g_uplink.sent_off : total - g_uplink.sent_off;
+        size_t space = tcp_sndbuf(tpcb);
+        if (n > space)
+            n = space;
+        if (n > TCP_MSS)
+            n = TCP_MSS;
+        if (n == 0 || tcp_sndqueuelen(tpcb) >= TCP_SND_QUEUELEN)
+            break;
+        u8_t flags = TCP_WRITE_FLAG_COPY;
+        if (g_uplink.sent_off + n < total)
+            flags |= TCP_WRITE_FLAG_MORE;
+        err_t err = tcp_write(tpcb, src, (u16_t)n, flags);
+        if (err == ERR_MEM)
+            break;
+        if (err != ERR_OK)
+            return err;
+        g_uplink.sent_off += n;
+        queued = true;
     }
+    if (queued)
+        tcp_output(tpcb);
+    return ERR_OK;
 }
 
-// -------------------- Funcoes de log --------------------
+// ACK do servidor: libera espaco para o restante do lote
+static err_t uplink_sent(void *arg, struct tcp_pcb *tpcb, u16_t len)
+{
+    if (uplink_send_more(tpcb) != ERR_OK)
+    {
+        err_t rc = uplink_close();
+        uplink_fail("falha ao enviar o lote");
+        return rc;
+    }
+    return ERR_OK;
+}
 
-// Adiciona uma nova linha ao log
-static void log_push(const char *fmt, ...)
+// Conectado: comeca a enviar cabecalho e corpo do lote
+static err_t uplink_connected(void *arg, struct tcp_pcb *tpcb, err_t err)
 {
-    va_list ap;
-    va_start(ap, fmt);
-    vsnprintf(g_log[g_log_head], LOG_LINE_MAX, fmt, ap);
-    va_end(ap);
+    g_uplink.sent_off = 0;
+    if (err != ERR_OK || uplink_send_more(tpcb) != ERR_OK)
+    {
+        tcp_arg(tpcb, NULL);
+        tcp_recv(tpcb, NULL);
+        tcp_sent(tpcb, NULL);
+        tcp_err(tpcb, NULL);
+        tcp_abort(tpcb);
+        g_uplink.pcb = NULL;
+        g_uplink.state = UPLINK_IDLE;
+        uplink_fail("falha ao enviar o lote");
+        return ERR_ABRT;
+    }
+    g_uplink.state = UPLINK_WAITING;
+    return ERR_OK;
+}
 
-    g_log_head = (g_log_head + 1) % LOG_CAP;
-    if (g_log_count < LOG_CAP) g_log_count++;
+// Chamado no loop do nucleo 1, fora do contexto do lwIP: trava a pilha durante as
+// chamadas tcp_* (o lwIP roda na IRQ com threadsafe_background)
+static void uplink_pump(void)
+{
+    if (LOG_UPLINK_HOST[0] == '\0')
+        return;
+    cyw43_arch_lwip_begin();
+    uplink_pump_locked();
+    cyw43_arch_lwip_end();
 }
 
-// Retorna a linha i (0 = mais antiga, g_log_count-1 = mais recente)
-static const char *log_get(int idx)
+// Inicia um envio quando ha linhas novas e controla o timeout (lwIP travado)
+static void uplink_pump_locked(void)
 {
-    if (idx < 0 || idx >= g_log_count) return "";
-    int start = (g_log_head - g_log_count + LOG_CAP) % LOG_CAP;
-    int i = (start + idx) % LOG_CAP;
-    return g_log[i];
+    uint32_t now = to_ms_since_boot(get_absolute_time());
+    if (g_uplink.state != UPLINK_IDLE)
+    {
+        if (now - g_uplink.started_ms >= UPLINK_TIMEOUT_MS)
+        {
+            if (g_uplink.pcb)
+            {
+                tcp_arg(g_uplink.pcb, NULL);
+                tcp_recv(g_uplink.pcb, NULL);
+                tcp_sent(g_uplink.pcb, NULL);
+                tcp_err(g_uplink.pcb, NULL);
+                tcp_abort(g_uplink.pcb);
+                g_uplink.pcb = NULL;
+            }
+            g_uplink.state = UPLINK_IDLE;
+            uplink_fail("sem resposta");
+        }
+        else if (g_uplink.state == UPLINK_WAITING && g_uplink.pcb &&
+                 g_uplink.sent_off < g_uplink.hdr_len + g_uplink.body_len)
+        {
+            // Retoma um envio que parou por ERR_MEM sem nada em voo (sem ACK para acordar)
+            if (uplink_send_more(g_uplink.pcb) != ERR_OK)
+            {
+                uplink_close();
+                uplink_fail("falha ao enviar o lote");
+            }
+        }
+        return;
+    }
+    if ((int32_t)(now - g_uplink.next_try_ms) < 0)
+        return;
+    g_uplink.next_try_ms = now + UPLINK_POLL_MS;
+
+    ip_addr_t addr;
+    if (!ipaddr_aton(LOG_UPLINK_HOST, &addr) || !uplink_build())
+        return;
+    struct tcp_pcb *pcb = tcp_new();
+    if (!pcb)
+    {
+        uplink_fail("sem memoria");
+        return;
+    }
+    tcp_recv(pcb, uplink_recv);
+    tcp_sent(pcb, uplink_sent);
+    tcp_err(pcb, uplink_err);
+    g_uplink.pcb = pcb;
+    g_uplink.resp_len = 0;
+    g_uplink.started_ms = now;
+    g_uplink.state = UPLINK_CONNECTING;
+    if (tcp_connect(pcb, &addr, LOG_UPLINK_PORT, uplink_connected) != ERR_OK)
+    {
+        tcp_err(pcb, NULL);
+        tcp_abort(pcb);
+        g_uplink.pcb = NULL;
+        g_uplink.state = UPLINK_IDLE;
+        uplink_fail("falha ao conectar");
+    }
 }
 
 // -------------------- Funcoes do display LCD I2C --------------------
 
-// Funcao para atualizar uma linha do display LCD com formatacao
+// Funcao para atualizar uma linha do display LCD com formatacao. So escreve no framebuffer
+// (qualquer nucleo); a task do LCD envia as mudancas ao display.
 void lcd_update_line(int line, const char *fmt, ...) {
-    if (g_lcd_mutex == NULL) return; // Mutex nao foi criado
+    if (line < 0 || line >= MAX_LINES) return;
 
     char buffer[17]; // 16 caracteres + \0
     memset(buffer, ' ', 16); // Preenche com espacos
@@ -1164,14 +4675,136 @@ void lcd_update_line(int line, const char *fmt, ...) {
     }
     buffer[16] = '\0'; // Garante o fim
 
-    // 3. Trava o mutex para proteger o I2C
-    if (xSemaphoreTake(g_lcd_mutex, pdMS_TO_TICKS(100)) == pdTRUE) {
-        
-        // 4. Posiciona o cursor e escreve
-        lcd_set_cursor(line, 0);
-        lcd_string(buffer);
-        
-        // 5. Libera o mutex
-        xSemaphoreGive(g_lcd_mutex);
+    // 3. Copia para o framebuffer (so conta como mudanca se o texto for outro)
+    bool changed = false;
+    critical_section_enter_blocking(&g_lcd_cs);
+    if (memcmp(g_lcd.fb[line], buffer, MAX_CHARS) != 0) {
+        memcpy(g_lcd.fb[line], buffer, MAX_CHARS);
+        g_lcd.version++;
+        changed = true;
+    }
+    critical_section_exit(&g_lcd_cs);
+    if (!changed || get_core_num() != 0) return;
+
+    // 4. Antes do scheduler nao ha task do LCD: o boot desenha na hora (nucleo 0)
+    if (xTaskGetSchedulerState() == taskSCHEDULER_NOT_STARTED)
+        lcd_render();
+    // 5. Numa task: acorda a task do LCD, que tem prioridade maior e desenha antes de quem
+    //    chamou seguir. Assim as fases escritas em sequencia (ex: "Movendo X/Y...") aparecem
+    else if (g_lcd_task && __get_current_exception() == 0)
+        xTaskNotifyGive(g_lcd_task);
+}
+
+// Prepara o framebuffer para um display recem-limpo (tudo em branco) e grava na CGRAM os
+// caracteres da barra de progresso (1 a 5 colunas preenchidas, codigos 1 a 5)
+static void lcd_fb_init(void) {
+    critical_section_init(&g_lcd_cs);
+    lcd_clear();
+    for (int cols = 1; cols <= 5; cols++) {
+        uint8_t rows[8] = {0};
+        for (int r = 1; r < 7; r++) rows[r] = (0x1F << (5 - cols)) & 0x1F;
+        lcd_create_char(cols, rows);
+    }
+    memset(g_lcd.fb, ' ', sizeof(g_lcd.fb));
+    memset(g_lcd.shown, ' ', sizeof(g_lcd.shown));
+    g_lcd.version = 0;
+    g_lcd.drawn = 0;
+}
+
+// Envia ao display apenas os trechos do framebuffer que mudaram. Um caractere igual entre
+// duas mudancas e reenviado (custa o mesmo que reposicionar o cursor).
+static void lcd_render(void) {
+    if (g_lcd.version == g_lcd.drawn) return;
+
+    char want[MAX_LINES][MAX_CHARS];
+    critical_section_enter_blocking(&g_lcd_cs);
+    memcpy(want, g_lcd.fb, sizeof(want));
+    uint32_t version = g_lcd.version;
+    critical_section_exit(&g_lcd_cs);
+
+    if (g_lcd.bar_on) memcpy(want[1], g_lcd.bar, MAX_CHARS); // barra cobre a linha 1
+
+    for (int line = 0; line < MAX_LINES; line++) {
+        int col = 0;
+        while (col < MAX_CHARS) {
+            if (want[line][col] == g_lcd.shown[line][col]) { col++; continue; }
+            int start = col, end = col + 1;
+            for (int j = col + 1; j < MAX_CHARS; j++) {
+                if (want[line][j] != g_lcd.shown[line][j]) end = j + 1;
+                else if (j > end) break; // dois iguais seguidos: reposicionar sai mais barato
+            }
+            lcd_write_at(line, start, &want[line][start], end - start);
+            memcpy(&g_lcd.shown[line][start], &want[line][start], end - start);
+            col = end;
+        }
+    }
+    g_lcd.drawn = version;
+}
+
+// Linha 1 durante um movimento: barra + posicao (mm) + tempo restante, ex. "BBB  123,45  7s".
+// Recomposta no maximo a cada LCD_PROGRESS_MS e so em movimentos mais longos que isso.
+static void lcd_progress_update(void) {
+    static uint32_t last_ms = 0;
+    uint32_t now = to_ms_since_boot(get_absolute_time());
+
+    uint32_t gen = g_motion_progress.gen;
+    bool active = g_motion_progress.active;
+    uint32_t done = g_motion_progress.done;
+    uint32_t total = g_motion_progress.total;
+    uint32_t start_ms = g_motion_progress.start_ms;
+    long fx = g_motion_progress.from_x, fy = g_motion_progress.from_y, fz = g_motion_progress.from_z;
+    long dx = g_motion_progress.dx, dy = g_motion_progress.dy, dz = g_motion_progress.dz;
+    if (gen != g_motion_progress.gen)
+        return; // outro movimento comecou durante a copia: fica para a proxima volta
+
+    bool show = active && now - start_ms >= LCD_PROGRESS_MS;
+    if (!show)
+    {
+        if (g_lcd.bar_on)
+        {
+            critical_section_enter_blocking(&g_lcd_cs);
+            g_lcd.bar_on = false; // volta a mostrar a linha 1 do framebuffer
+            g_lcd.version++;
+            critical_section_exit(&g_lcd_cs);
+        }
+        return;
+    }
+    if (g_lcd.bar_on && now - last_ms < LCD_PROGRESS_MS)
+        return;
+    last_ms = now;
+
+    char line[MAX_CHARS + 1];
+    int fill = total ? (int)((uint64_t)done * LCD_BAR_CELLS * 5 / total) : 0;
+    for (int c = 0; c < LCD_BAR_CELLS; c++) {
+        int cols = fill - c * 5;
+        line[c] = cols >= 5 ? 5 : cols > 0 ? (char)cols : ' ';
+    }
+
+    // Cada eixo anda um passo por iteracao ate completar o seu deslocamento
+    long px = fx + (dx < 0 ? -1 : 1) * (labs(dx) < (long)done ? labs(dx) : (long)done);
+    long py = fy + (dy < 0 ? -1 : 1) * (labs(dy) < (long)done ? labs(dy) : (long)done);
+    long pz = fz + (dz < 0 ? -1 : 1) * (labs(dz) < (long)done ? labs(dz) : (long)done);
+    char pos[8];
+    if (dx || dy)
+        snprintf(pos, sizeof(pos), "%3d,%-3d", (int)(px / STEPS_PER_MM_X) % 1000, (int)(py / STEPS_PER_MM_Y) % 1000);
+    else
+        snprintf(pos, sizeof(pos), "Z %3dmm", (int)(pz / STEPS_PER_MM_Z) % 1000);
+
+    char eta[4] = "--s";
+    if (done > 0)
+    {
+        uint64_t left_ms = (uint64_t)(now - start_ms) * (total - done) / done;
+        uint32_t left_s = (uint32_t)((left_ms + 999) / 1000);
+        snprintf(eta, sizeof(eta), "%2lus", (unsigned long)(left_s > 99 ? 99 : left_s));
+    }
+    snprintf(line + LCD_BAR_CELLS, sizeof(line) - LCD_BAR_CELLS, " %-7s %3s", pos, eta);
+
+    critical_section_enter_blocking(&g_lcd_cs);
+    if (!g_lcd.bar_on || memcmp(g_lcd.bar, line, MAX_CHARS) != 0)
+    {
+        memcpy(g_lcd.bar, line, MAX_CHARS);
+        g_lcd.bar_on = true;
+        g_lcd.version++;
     }
+    critical_section_exit(&g_lcd_cs);
 }
@@ -75,6 +75,21 @@ def init_db():
         )
     ''')
     
+    # Última seq de log recebida de cada dispositivo (envio em lotes pelo firmware),
+    # identificado pelo id único da placa; boot_id é o id do boot que enviou o último lote.
+    # A versão antiga era indexada pelo IP: só guardava marcas d'água, então é recriada.
+    cursor.execute("PRAGMA table_info(device_uplink)")
+    uplink_cols = [col[1] for col in cursor.fetchall()]
+    if uplink_cols and 'device_id' not in uplink_cols:
+        cursor.execute('DROP TABLE device_uplink')
+    cursor.execute('''
+        CREATE TABLE IF NOT EXISTS device_uplink (
+            device_id TEXT PRIMARY KEY,
+            boot_id INTEGER NOT NULL,
+            last_seq INTEGER NOT NULL
+        )
+    ''')
+    
     # Criar usuário admin padrão
     try:
         admin_password = hash_password("admin123")  #[MODIFICAR] # Senha padrão do admin
@@ -437,6 +452,73 @@ def add_log():
         print(f"Erro ao adicionar log: {str(e)}")
         return jsonify({'error': str(e)}), 500
 
+@app.route('/api/logs/batch', methods=['POST'])
+def add_logs_batch():
+    """Adiciona um lote de logs enviado pelo firmware (uma requisição por lote).
+
+    O lote traz o id da placa (device), o id do boot (boot) e o intervalo de seqs que
+    cobre (from+1 até to). Linhas já recebidas são ignoradas, então reenvios são seguros.
+    Se a seq volta para trás (log da flash apagado, regravação do firmware), a marca
+    d'água do dispositivo é reiniciada em vez de descartar as linhas novas.
+    A resposta devolve last_seq: o firmware só avança a sua marca d'água se ela for o 'to'."""
+    try:
+        data = request.json
+        if not data or not isinstance(data.get('entries'), list):
+            return jsonify({'error': 'Entries are required'}), 400
+        device_id = data.get('device')
+        if not device_id:
+            return jsonify({'error': 'Device is required'}), 400
+        try:
+            boot_id = int(data.get('boot', 0))
+            first = int(data['from'])
+            last = int(data['to'])
+        except (KeyError, TypeError, ValueError):
+            return jsonify({'error': 'Boot, from and to are required'}), 400
+        if last < first:
+            return jsonify({'error': 'Invalid seq range'}), 400
+
+        device_ip = request.remote_addr
+        conn = sqlite3.connect(DB_PATH, check_same_thread=False)
+        cursor = conn.cursor()
+        cursor.execute('SELECT boot_id, last_seq FROM device_uplink WHERE device_id = ?', (device_id,))
+        row = cursor.fetchone()
+
+        # Continuação: no mesmo boot o lote termina depois do já recebido (ou é um reenvio);
+        # num boot novo ele começa depois do já recebido. Qualquer outro caso é um log reiniciado.
+        if row is None:
+            last_seq = first
+        elif (last >= row[1]) if row[0] == boot_id else (first >= row[1]):
+            last_seq = row[1]
+        else:
+            print(f"Lote de logs - seq de {device_id} voltou de {row[1]} para {first}: reiniciando")
+            last_seq = first
+
+        inserted = 0
+        for entry in data['entries']:
+            seq = int(entry.get('seq', 0))
+            if seq <= last_seq or seq > last:
+                continue
+            cursor.execute(
+                'INSERT INTO logs (message, device_ip, level) VALUES (?, ?, ?)',
+                (entry.get('msg', ''), device_ip, entry.get('level', 'INFO'))
+            )
+            inserted += 1
+        last_seq = max(last_seq, last)
+
+        cursor.execute(
+            'INSERT OR REPLACE INTO device_uplink (device_id, boot_id, last_seq) VALUES (?, ?, ?)',
+            (device_id, boot_id, last_seq)
+        )
+        conn.commit()
+        conn.close()
+
+        print(f"Lote de logs - {inserted} linhas de {device_id} em {device_ip} (última seq {last_seq})")
+        return jsonify({'status': 'success', 'inserted': inserted, 'last_seq': last_seq})
+
+    except Exception as e:
+        print(f"Erro ao adicionar lote de logs: {str(e)}")
+        return jsonify({'error': str(e)}), 500
+
 @app.route('/api/logs', methods=['GET'])
 def get_logs():
     """Recupera logs do banco de dados"""
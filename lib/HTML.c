@@ -2,15 +2,9 @@
 #include <string.h>
 #include <stdlib.h>
 
-// Cria a resposta HTML em um buffer maior
-char html[65536]; // 64KB - tamanho para HTML completo com login
-
-void preencher_html() {
-    snprintf(html, sizeof(html),
-        "HTTP/1.1 200 OK\r\n"
-        "Content-Type: text/html\r\n"
-        "Cache-Control: no-cache, no-store, must-revalidate\r\n"
-        "\r\n"
+// Corpo da pagina HTML, constante em flash: o servidor envia direto daqui, sem copia
+// (os cabecalhos HTTP, incluindo o ETag, sao gerados pelo servidor)
+const char html[] =
         "<!DOCTYPE html>\n"
         "<html lang=\"pt-BR\">\n"
         "<head>\n"
@@ -44,7 +38,7 @@ void preencher_html() {
         "        .pallet-info{margin-top:1rem;font-weight:bold;color:var(--cor-sucesso)}\n"
         "        .control-group{margin-bottom:2rem}\n"
         "        form{display:flex;flex-direction:column;gap:.75rem}\n"
-        "        input[type=\"text\"],input[type=\"password\"],input[type=\"number\"],input[type=\"date\"]{width:100%%;padding:.75rem;border:1px solid var(--cor-borda);border-radius:4px;font-size:1rem}\n"
+        "        input[type=\"text\"],input[type=\"password\"],input[type=\"number\"],input[type=\"date\"]{width:100%;padding:.75rem;border:1px solid var(--cor-borda);border-radius:4px;font-size:1rem}\n"
         "        button{padding:.75rem 1rem;border:none;border-radius:4px;background-color:var(--cor-primaria);color:white;font-size:1rem;font-weight:bold;cursor:pointer;transition:background-color .2s ease}\n"
         "        button:hover{background-color:#004a80}\n"
         "        button.storage-active{background-color:var(--cor-sucesso)}\n"
@@ -53,8 +47,8 @@ void preencher_html() {
         "        #log-container{background-color:#f8f9fa;border:1px solid var(--cor-borda);border-radius:4px;padding:1rem;height:150px;overflow-y:auto;font-family:\"Courier New\",monospace;font-size:.9rem}\n"
         "        #log-container p{padding-bottom:.5rem;border-bottom:1px solid #eee}\n"
         "        #log-container p:last-child{border-bottom:none}\n"
-        "        .popup-overlay{position:fixed;top:0;left:0;width:100%%;height:100%%;background-color:rgba(0,0,0,.5);display:none;justify-content:center;align-items:center;z-index:1000}\n"
-        "        .popup{background-color:white;padding:2rem;border-radius:8px;box-shadow:0 4px 20px rgba(0,0,0,.3);text-align:center;max-width:400px;width:90%%}\n"
+        "        .popup-overlay{position:fixed;top:0;left:0;width:100%;height:100%;background-color:rgba(0,0,0,.5);display:none;justify-content:center;align-items:center;z-index:1000}\n"
+        "        .popup{background-color:white;padding:2rem;border-radius:8px;box-shadow:0 4px 20px rgba(0,0,0,.3);text-align:center;max-width:400px;width:90%}\n"
         "        .popup h3{margin-bottom:1rem;color:var(--cor-primaria)}\n"
         "        .popup-buttons{display:flex;gap:1rem;justify-content:center;margin-top:1.5rem}\n"
         "        .popup-buttons button{padding:.5rem 1.5rem}\n"
@@ -70,14 +64,14 @@ void preencher_html() {
         "        #dashboard-product-list li{padding:0.5rem 1rem;border-bottom:1px solid #eee}\n"
         "        #dashboard-product-list li:last-child{border-bottom:none}\n"
         "        #dashboard-product-list li span{font-weight:bold;color:var(--cor-primaria)}\n"
-        "        .login-container{display:flex;align-items:center;justify-content:center;min-height:100vh;background:linear-gradient(135deg,#667eea 0%%,#764ba2 100%%)}\n"
-        "        .login-box{background:white;padding:2rem;border-radius:8px;box-shadow:0 10px 40px rgba(0,0,0,0.3);width:100%%;max-width:400px}\n"
+        "        .login-container{display:flex;align-items:center;justify-content:center;min-height:100vh;background:linear-gradient(135deg,#667eea 0%,#764ba2 100%)}\n"
+        "        .login-box{background:white;padding:2rem;border-radius:8px;box-shadow:0 10px 40px rgba(0,0,0,0.3);width:100%;max-width:400px}\n"
         "        .login-box h1{text-align:center;color:#333;margin-bottom:1.5rem;font-size:1.8rem}\n"
         "        .login-box .form-group{margin-bottom:1rem}\n"
         "        .login-box .form-group label{display:block;margin-bottom:0.5rem;color:#555;font-weight:bold}\n"
-        "        .login-box .form-group input{width:100%%;padding:0.75rem;border:1px solid #ddd;border-radius:4px;font-size:1rem}\n"
+        "        .login-box .form-group input{width:100%;padding:0.75rem;border:1px solid #ddd;border-radius:4px;font-size:1rem}\n"
         "        .login-box .form-group input:focus{outline:none;border-color:#667eea;box-shadow:0 0 0 3px rgba(102,126,234,0.1)}\n"
-        "        .login-box .login-btn{width:100%%;padding:0.75rem;background:#667eea;color:white;border:none;border-radius:4px;font-size:1rem;font-weight:bold;cursor:pointer;transition:background 0.2s}\n"
+        "        .login-box .login-btn{width:100%;padding:0.75rem;background:#667eea;color:white;border:none;border-radius:4px;font-size:1rem;font-weight:bold;cursor:pointer;transition:background 0.2s}\n"
         "        .login-box .login-btn:hover{background:#764ba2}\n"
         "        .error-msg{color:var(--cor-erro);text-align:center;margin-bottom:1rem;display:none;padding:0.75rem;background-color:#ffe0e0;border-radius:4px}\n"
         "        .user-header{display:flex;justify-content:space-between;align-items:center;margin-bottom:1rem;padding:0 0 1rem 0;border-bottom:1px solid var(--cor-borda)}\n"
@@ -109,9 +103,9 @@ void preencher_html() {
         "    </div>\n"
         "\n"
         "    <!-- PAINEL DE CONTROLE (DASHBOARD) -->\n"
-        "    <div id=\"dashboard\" style=\"display:none;width:100%%\">\n"
+        "    <div id=\"dashboard\" style=\"display:none;width:100%\">\n"
         "        <header class=\"main-header\">\n"
-        "            <div style=\"display:flex;justify-content:space-between;align-items:center;width:100%%\">\n"
+        "            <div style=\"display:flex;justify-content:space-between;align-items:center;width:100%\">\n"
         "                <h1>Painel de Controle - Armazém Automatizado XYZ</h1>\n"
         "                <div class=\"user-info\" style=\"color:white;text-align:right\">\n"
         "                    <span id=\"username-display\">Bem-vindo</span>\n"
@@ -308,6 +302,27 @@ void preencher_html() {
         "            updateDashboard();\n"
         "            setInterval(updateDashboard, 10000);\n"
         "\n"
+        "            // Estado ao vivo da maquina via Server-Sent Events\n"
+        "            function setMagnetUi(active) {\n"
+        "                electromagnetActive = active;\n"
+        "                electromagnetStatus.textContent = active ? 'Ativado' : 'Desativado';\n"
+        "                electromagnetBtn.textContent = active ? 'Desativar Eletroímã' : 'Ativar Eletroímã';\n"
+        "            }\n"
+        "            function setCellUi(slot, uid) {\n"
+        "                const cell = document.querySelector(`[data-position=\"${slot}\"]`);\n"
+        "                if (cell) cell.classList.toggle('occupied', uid !== '');\n"
+        "            }\n"
+        "            if (window.EventSource) {\n"
+        "                const events = new EventSource('/api/events');\n"
+        "                events.addEventListener('state', e => {\n"
+        "                    const st = JSON.parse(e.data);\n"
+        "                    setMagnetUi(st.magnet);\n"
+        "                    Object.keys(st.cells || {}).forEach(slot => setCellUi(slot, st.cells[slot]));\n"
+        "                });\n"
+        "                events.addEventListener('magnet', e => setMagnetUi(JSON.parse(e.data).active));\n"
+        "                events.addEventListener('inventory', e => { const d = JSON.parse(e.data); setCellUi(d.slot, d.uid); });\n"
+        "            }\n"
+        "\n"
         "            rackCells.forEach(cell => {\n"
         "                cell.addEventListener('click', function () {\n"
         "                    currentSlot = this.getAttribute('data-position');\n"
@@ -488,6 +503,6 @@ void preencher_html() {
         "        });\n"
         "    </script>\n"
         "</body>\n"
-        "</html>\n"
-    );
-}
+        "</html>\n";
+
+const size_t html_len = sizeof(html) - 1;
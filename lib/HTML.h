@@ -1,8 +1,9 @@
 #ifndef HTML_H
 #define HTML_H
 
-extern char html[16384]; // Buffer para HTML (16KB)
+#include <stddef.h>
 
-void preencher_html(void);
+extern const char html[];    // Corpo HTML (constante em flash)
+extern const size_t html_len; // Tamanho do corpo HTML, sem o '\0'
 
 #endif
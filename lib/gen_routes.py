@@ -0,0 +1,88 @@
+#!/usr/bin/env python3
+"""Gera lib/http_routes.h: a tabela de rotas HTTP com hash perfeito do Controle_XYZ.c.
+
+Cada rota ocupa o slot route_hash(metodo, caminho) da tabela. O script procura, a partir
+do offset do FNV-1a, a primeira semente sem colisao e grava os slots no cabecalho.
+Ao adicionar ou remover uma rota, edite ROUTES e rode:
+
+    python lib/gen_routes.py           # regrava lib/http_routes.h
+    python lib/gen_routes.py --check   # falha se o cabecalho estiver desatualizado
+"""
+import os
+import sys
+
+TABLE_SIZE = 32  # potencia de 2
+FNV_OFFSET = 0x811C9DC5
+FNV_PRIME = 16777619
+
+# (metodo, caminho, handler, limitada por IP)
+ROUTES = [
+    ("GET",  "/",                         "route_page",                 False),
+    ("POST", "/store",                    "route_store",                True),
+    ("POST", "/retrieve",                 "route_retrieve",             True),
+    ("POST", "/home",                     "route_home",                 True),
+    ("POST", "/toggle-electromagnet",     "route_toggle_electromagnet", True),
+    ("GET",  "/api/electromagnet-status", "route_electromagnet_status", False),
+    ("GET",  "/api/state",                "route_state",                False),
+    ("GET",  "/api/log",                  "route_log_get",              True),
+    ("POST", "/api/log",                  "route_log_post",             True),
+    ("GET",  "/api/log-level",            "route_log_level",            False),
+    ("POST", "/api/log-level",            "route_log_level",            True),
+    ("GET",  "/api/history",              "route_history",              False),
+    ("GET",  "/api/events",               "route_events",               False),
+    ("GET",  "/api/ws",                   "route_ws",                   False),
+    ("GET",  "/api/connections",          "route_connections",          False),
+]
+
+OUT = os.path.join(os.path.dirname(os.path.abspath(__file__)), "http_routes.h")
+
+
+def route_hash(seed, method, path):
+    """Mesmo calculo de route_hash() no firmware: FNV-1a de "METODO caminho"."""
+    h = seed
+    for c in (method + " " + path).encode():
+        h = ((h ^ c) * FNV_PRIME) & 0xFFFFFFFF
+    return (h ^ (h >> 16)) & (TABLE_SIZE - 1)
+
+
+def find_seed():
+    for seed in range(FNV_OFFSET, FNV_OFFSET + 0x100000):
+        slots = [route_hash(seed, m, p) for m, p, _, _ in ROUTES]
+        if len(set(slots)) == len(slots):
+            return seed, slots
+    sys.exit("gen_routes: nenhuma semente sem colisao; aumente TABLE_SIZE")
+
+
+def render(seed, slots):
+    lines = [
+        "// Gerado por lib/gen_routes.py -- nao edite; altere ROUTES no script e rode-o de novo.",
+        "#ifndef HTTP_ROUTES_H",
+        "#define HTTP_ROUTES_H",
+        "",
+        "#define ROUTE_TABLE_SIZE %d" % TABLE_SIZE,
+        "#define ROUTE_HASH_SEED 0x%08xu" % seed,
+        "",
+        "// X(slot, metodo, caminho, handler, limitada)",
+        "#define HTTP_ROUTES(X) \\",
+    ]
+    width = max(len(p) for _, p, _, _ in ROUTES) + 3
+    for slot, (method, path, handler, limited) in sorted(zip(slots, ROUTES)):
+        lines.append("    X(%2d, %-7s %-*s %s, %s) \\" % (
+            slot, '"%s",' % method, width, '"%s",' % path, handler, "true" if limited else "false"))
+    lines += ["", "#endif", ""]
+    return "\n".join(lines)
+
+
+def main():
+    text = render(*find_seed())
+    if "--check" in sys.argv[1:]:
+        with open(OUT) as f:
+            if f.read() != text:
+                sys.exit("gen_routes: %s desatualizado; rode python lib/gen_routes.py" % OUT)
+        return
+    with open(OUT, "w") as f:
+        f.write(text)
+
+
+if __name__ == "__main__":
+    main()
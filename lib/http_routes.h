@@ -0,0 +1,26 @@
+// Gerado por lib/gen_routes.py -- nao edite; altere ROUTES no script e rode-o de novo.
+#ifndef HTTP_ROUTES_H
+#define HTTP_ROUTES_H
+
+#define ROUTE_TABLE_SIZE 32
+#define ROUTE_HASH_SEED 0x811c9e13u
+
+// X(slot, metodo, caminho, handler, limitada)
+#define HTTP_ROUTES(X) \
+    X( 2, "GET",  "/api/events",               route_events, false) \
+    X( 5, "GET",  "/api/connections",          route_connections, false) \
+    X( 6, "POST", "/retrieve",                 route_retrieve, true) \
+    X( 8, "GET",  "/api/state",                route_state, false) \
+    X( 9, "POST", "/home",                     route_home, true) \
+    X(10, "POST", "/api/log",                  route_log_post, true) \
+    X(11, "GET",  "/api/ws",                   route_ws, false) \
+    X(12, "POST", "/toggle-electromagnet",     route_toggle_electromagnet, true) \
+    X(13, "GET",  "/api/log-level",            route_log_level, false) \
+    X(15, "GET",  "/api/history",              route_history, false) \
+    X(18, "POST", "/store",                    route_store, true) \
+    X(24, "GET",  "/",                         route_page, false) \
+    X(25, "GET",  "/api/electromagnet-status", route_electromagnet_status, false) \
+    X(29, "GET",  "/api/log",                  route_log_get, true) \
+    X(31, "POST", "/api/log-level",            route_log_level, true) \
+
+#endif
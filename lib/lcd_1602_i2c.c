@@ -1,17 +1,32 @@
 /**
  * @file lcd_1602_i2c.c
  * @brief Implementação da biblioteca refatorada para LCD 16x2 I2C.
+ *
+ * Cada byte para o LCD vira uma sequência de estados do PCF8574 (dados, enable alto,
+ * enable baixo) montada num buffer e enviada numa única transação I2C por DMA.
+ * O tempo de cada byte no barramento já cumpre o pulso de enable e o tempo de
+ * execução das instruções, então não há sleep entre os nibbles.
  */
 
 #include "lcd_1602_i2c.h"
 #include <string.h>
 #include "pico/stdlib.h"
 #include "hardware/i2c.h"
+#include "hardware/dma.h"
 
 // Variáveis estáticas para armazenar a configuração do I2C
 static i2c_inst_t *i2c_port;
 static uint8_t i2c_addr;
 
+// Transação em montagem: cada palavra vai direto para o IC_DATA_CMD (bit 9 = STOP)
+#define LCD_TX_MAX 128              // palavras por transação (25 bytes do LCD)
+#define LCD_TX_TIMEOUT_US 20000     // 128 bytes a 100 kHz levam ~12 ms
+#define LCD_CLEAR_US 2000           // clear/home levam 1,52 ms no HD44780
+static uint16_t tx_buf[LCD_TX_MAX];
+static size_t tx_len;
+static int dma_chan = -1;           // -1: sem canal livre, a FIFO é alimentada pela CPU
+static dma_channel_config dma_cfg;
+
 /* Função auxiliar para escrita de um byte no barramento I2C */
 static void i2c_write_byte(uint8_t val) {
     i2c_write_blocking(i2c_port, i2c_addr, &val, 1, false);
@@ -28,8 +43,9 @@ static void lcd_toggle_enable(uint8_t val) {
     sleep_us(DELAY_US);
 }
 
-// Envia um byte como duas transferências de 4 bits (nibbles)
-void lcd_send_byte(uint8_t val, int mode) {
+// Envia um byte com uma escrita I2C por estado e pausas longas (só no reset do display,
+// quando o controlador ainda pode estar em modo 8 bits e lento)
+static void lcd_send_byte_slow(uint8_t val, int mode) {
     uint8_t high = mode | (val & 0xF0) | LCD_BACKLIGHT;
     uint8_t low = mode | ((val << 4) & 0xF0) | LCD_BACKLIGHT;
 
@@ -39,8 +55,68 @@ void lcd_send_byte(uint8_t val, int mode) {
     lcd_toggle_enable(low);
 }
 
+// Envia a transação montada e espera o último byte sair do barramento
+static void lcd_flush(void) {
+    if (tx_len == 0) return;
+    i2c_hw_t *hw = i2c_get_hw(i2c_port);
+    tx_buf[tx_len - 1] |= I2C_IC_DATA_CMD_STOP_BITS;
+
+    hw->enable = 0;
+    hw->tar = i2c_addr;
+    hw->enable = I2C_IC_ENABLE_ENABLE_BITS;
+
+    uint32_t t0 = time_us_32();
+    if (dma_chan >= 0) {
+        dma_channel_configure(dma_chan, &dma_cfg, &hw->data_cmd, tx_buf, tx_len, true);
+        while (dma_channel_is_busy(dma_chan)) {
+            if (time_us_32() - t0 > LCD_TX_TIMEOUT_US) {
+                dma_channel_abort(dma_chan);
+                break;
+            }
+            tight_loop_contents();
+        }
+    } else {
+        for (size_t i = 0; i < tx_len; i++) {
+            while (i2c_get_write_available(i2c_port) == 0 && time_us_32() - t0 <= LCD_TX_TIMEOUT_US)
+                tight_loop_contents();
+            hw->data_cmd = tx_buf[i];
+        }
+    }
+
+    // FIFO vazia e barramento parado: o STOP saiu
+    while ((!(hw->status & I2C_IC_STATUS_TFE_BITS) || (hw->status & I2C_IC_STATUS_ACTIVITY_BITS)) &&
+           time_us_32() - t0 <= LCD_TX_TIMEOUT_US)
+        tight_loop_contents();
+    if (hw->tx_abrt_source & I2C_IC_TX_ABRT_SOURCE_BITS)
+        (void)hw->clr_tx_abrt; // sem ACK (display ausente): descarta e libera a FIFO
+    tx_len = 0;
+}
+
+// Acrescenta um byte (comando ou dado) à transação: dados com enable baixo, enable alto,
+// enable baixo, para cada nibble. Dados e RS ficam estáveis um byte antes do pulso, e
+// entre dois bytes do LCD passam 3 bytes do barramento (67 us a 400 kHz, acima dos 37 us
+// de execução de uma instrução).
+static void lcd_queue_byte(uint8_t val, int mode) {
+    if (tx_len + 5 > LCD_TX_MAX) lcd_flush();
+    uint8_t high = mode | (val & 0xF0) | LCD_BACKLIGHT;
+    uint8_t low = mode | ((val << 4) & 0xF0) | LCD_BACKLIGHT;
+
+    tx_buf[tx_len++] = high;
+    tx_buf[tx_len++] = high | LCD_ENABLE_BIT;
+    tx_buf[tx_len++] = high;
+    tx_buf[tx_len++] = low | LCD_ENABLE_BIT;
+    tx_buf[tx_len++] = low;
+}
+
+// Envia um byte como duas transferências de 4 bits (nibbles), numa única transação
+void lcd_send_byte(uint8_t val, int mode) {
+    lcd_queue_byte(val, mode);
+    lcd_flush();
+}
+
 void lcd_clear(void) {
     lcd_send_byte(LCD_CLEARDISPLAY, LCD_COMMAND);
+    sleep_us(LCD_CLEAR_US);
 }
 
 void lcd_set_cursor(int line, int position) {
@@ -50,24 +126,53 @@ void lcd_set_cursor(int line, int position) {
 
 void lcd_string(const char *s) {
     while (*s) {
-        lcd_char(*s++);
+        lcd_queue_byte(*s++, LCD_CHARACTER);
     }
+    lcd_flush();
 }
 
 void lcd_char(char val) {
     lcd_send_byte(val, LCD_CHARACTER);
 }
 
+void lcd_write_at(int line, int position, const char *s, int len) {
+    int val = (line == 0) ? 0x80 + position : 0xC0 + position;
+    lcd_queue_byte(val, LCD_COMMAND);
+    for (int i = 0; i < len; i++) {
+        lcd_queue_byte(s[i], LCD_CHARACTER);
+    }
+    lcd_flush();
+}
+
+void lcd_create_char(uint8_t location, const uint8_t rows[8]) {
+    lcd_queue_byte(LCD_SETCGRAMADDR | ((location & 0x07) << 3), LCD_COMMAND);
+    for (int i = 0; i < 8; i++) {
+        lcd_queue_byte(rows[i], LCD_CHARACTER);
+    }
+    lcd_queue_byte(LCD_SETDDRAMADDR, LCD_COMMAND); // volta a escrever no display
+    lcd_flush();
+}
+
 void lcd_init(i2c_inst_t *i2c, uint8_t addr) {
     // Armazena a configuração do I2C
     i2c_port = i2c;
     i2c_addr = addr;
 
-    // Sequência de inicialização do LCD
-    lcd_send_byte(0x03, LCD_COMMAND);
-    lcd_send_byte(0x03, LCD_COMMAND);
-    lcd_send_byte(0x03, LCD_COMMAND);
-    lcd_send_byte(0x02, LCD_COMMAND);
+    // Canal de DMA alimentando a FIFO de transmissão (i2c_init já liga o DREQ de TX)
+    dma_chan = dma_claim_unused_channel(false);
+    if (dma_chan >= 0) {
+        dma_cfg = dma_channel_get_default_config(dma_chan);
+        channel_config_set_transfer_data_size(&dma_cfg, DMA_SIZE_16);
+        channel_config_set_read_increment(&dma_cfg, true);
+        channel_config_set_write_increment(&dma_cfg, false);
+        channel_config_set_dreq(&dma_cfg, i2c_get_dreq(i2c, true));
+    }
+
+    // Sequência de inicialização do LCD (reset para o modo 4 bits com pausas longas)
+    lcd_send_byte_slow(0x03, LCD_COMMAND);
+    lcd_send_byte_slow(0x03, LCD_COMMAND);
+    lcd_send_byte_slow(0x03, LCD_COMMAND);
+    lcd_send_byte_slow(0x02, LCD_COMMAND);
 
     lcd_send_byte(LCD_ENTRYMODESET | LCD_ENTRYLEFT, LCD_COMMAND);
     lcd_send_byte(LCD_FUNCTIONSET | LCD_2LINE, LCD_COMMAND);
@@ -87,6 +87,27 @@ void lcd_string(const char *s);
  */
 void lcd_char(char val);
 
+/**
+ * @brief Escreve len caracteres a partir de uma posição, numa única transação I2C.
+ *
+ * @param line Linha (0 ou 1).
+ * @param position Coluna (0 a 15).
+ * @param s Caracteres (não precisa terminar em '\0').
+ * @param len Quantidade de caracteres.
+ */
+void lcd_write_at(int line, int position, const char *s, int len);
+
+/**
+ * @brief Define um caractere personalizado na CGRAM.
+ *
+ * Depois, o caractere aparece ao escrever o código location (0 a 7). O cursor volta
+ * para o início da linha 0.
+ *
+ * @param location Código do caractere (0 a 7).
+ * @param rows As 8 linhas do caractere (5 bits menos significativos, coluna da esquerda no bit 4).
+ */
+void lcd_create_char(uint8_t location, const uint8_t rows[8]);
+
 /**
  * @brief Envia um byte (comando ou dado) para o LCD.
  *
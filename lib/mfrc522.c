@@ -57,6 +57,8 @@ void PCD_WriteRegister(MFRC522Ptr_t mfrc, uint8_t reg, uint8_t value) {
 /**
  * Writes a number of uint8_ts to the specified register in the MFRC522 chip.
  * The interface is described in the datasheet section 8.1.2.
+ * Burst write: one address byte followed by all values under a single CS assertion
+ * (the values are sent straight from the caller's buffer, without a copy).
  */
 void PCD_WriteNRegister(
 	MFRC522Ptr_t mfrc,
@@ -64,16 +66,14 @@ void PCD_WriteNRegister(
 	uint8_t count, ///< The number of uint8_ts to write to the register
 	uint8_t *values ///< The values to write. uint8_t array.
 	) {
-	uint8_t msg[count + 1]; //Values and address
-	msg[0] = 0x00 | reg;
-
-	uint8_t i;
-	for(i = 0; i < count; i++) {
-		msg[i + 1] = values[i];
+	if (count == 0) {
+		return;
 	}
+	const uint8_t address = 0x00 | reg;
 
 	cs_select(mfrc->_chipSelectPin);
-	spi_write_blocking(mfrc->spi, msg, count + 1);
+	spi_write_blocking(mfrc->spi, &address, 1);
+	spi_write_blocking(mfrc->spi, values, count);
 	cs_deselect(mfrc->_chipSelectPin);
 }
 
@@ -98,6 +98,9 @@ uint8_t PCD_ReadRegister(
 /**
  * Reads a number of uint8_ts from the specified register in the MFRC522 chip.
  * The interface is described in the datasheet section 8.1.2.
+ * Burst read: under a single CS assertion the address is sent count times followed by
+ * 0x00, and the byte clocked in with each of those is the next value. The FIFO (64 bytes)
+ * is read with one spi_write_read_blocking straight into values.
  */
 void PCD_ReadNRegister(
 	MFRC522Ptr_t mfrc,
@@ -106,25 +109,31 @@ void PCD_ReadNRegister(
 	uint8_t *values, ///< uint8_t array to store the values in.
 	uint8_t rxAlign ///< Only bit positions rxAlign..7 in values[0] are updated.
 	) {
-	uint8_t buf = 0;
-	const uint8_t msg = 0x80 | reg;
-	
-	cs_select(mfrc->_chipSelectPin);
-
-	// uint8_t i;
-	// for(i = 0; i < count; i++) {
-	// 	uint8_t value = 0;
-	// 	spi_write_blocking(mfrc->spi, &msg, 1);
-	// 	spi_read_blocking(mfrc->spi, 0, &value, 1);
-	// 	values[i] = value;
-	// }
-
-	uint8_t i;
-	for(i = 0; i < count; i++) {
-		values[i] = PCD_ReadRegister(mfrc, msg);
+	if (count == 0) {
+		return;
 	}
+	const uint8_t address = 0x80 | reg;
+	uint8_t tx[MFRC522_BURST_MAX];
+	uint8_t first = values[0];
 
+	cs_select(mfrc->_chipSelectPin);
+	spi_write_blocking(mfrc->spi, &address, 1); // The byte clocked in here is undefined
+	uint8_t done = 0;
+	while (done < count) {
+		uint8_t n = (count - done > MFRC522_BURST_MAX) ? MFRC522_BURST_MAX : count - done;
+		memset(tx, address, n);
+		if (done + n == count) {
+			tx[n - 1] = 0x00; // Last byte of the stream: no further read
+		}
+		spi_write_read_blocking(mfrc->spi, tx, values + done, n);
+		done += n;
+	}
 	cs_deselect(mfrc->_chipSelectPin);
+
+	if (rxAlign) { // Only update bit positions rxAlign..7 in values[0]
+		uint8_t mask = (0xFF << rxAlign) & 0xFF;
+		values[0] = (first & ~mask) | (values[0] & mask);
+	}
 }
 
 /**
@@ -27,6 +27,7 @@
  ******************************************************************************/
 // send only one byte per transfer, see WriteRegister functions
 #define BUFFER_SIZE  1 
+#define MFRC522_BURST_MAX 64 // bytes per SPI burst (size of the MFRC522 FIFO)
 // Defined as 4MHz in the original library
 #define MFRC522_BIT_RATE 4000000 
 // Used for ADT object allocation
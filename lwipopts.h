@@ -21,6 +21,8 @@
 #define MEM_ALIGNMENT               4
 #define MEM_SIZE                    4000
 #define MEMP_NUM_TCP_SEG            32
+#define MEMP_NUM_TCP_PCB            16
+#define TCP_LISTEN_BACKLOG          1
 #define MEMP_NUM_ARP_QUEUE          10
 #define PBUF_POOL_SIZE              24
 #define LWIP_ARP                    1